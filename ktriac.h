@@ -17,8 +17,20 @@
 #define GPIO_ACFREQ                     9
 
 //GPIO pin of output circuit, turns TRIAC on
+//Used as the only channel if no "gpios" module parameter is given
 #define GPIO_TRIAC                      10
 
+//Maximum number of TRIAC outputs driven by one module instance
+#define KTRIAC_MAX_CHANNELS             16
+
+//GPIO pin of the tachometer of the speed control, -1: none
+//Used if no "tacho_gpio" module parameter is given
+#define GPIO_TACHO                      -1
+
+//GPIO pin of the load current sense input of the calibration, -1: none
+//Used if no "sense_gpio" module parameter is given
+#define GPIO_SENSE                      -1
+
 
 
 /***********************************
@@ -26,8 +38,8 @@
  * 
  * *********************************/
 
-//50Hz the default AC_FREQ -> will be set at loading the module
-#define AC_DEFAULT_FREQ                  50
+//the default AC_FREQ -> will be set at loading the module, 0: detect 50 or 60Hz
+#define AC_DEFAULT_FREQ                  0
 
 /***
  * Zerocross detection tolerance, helpful is the detection circuit noisy is.
@@ -38,12 +50,104 @@
 ***/
 #define AC_DEFAULT_TOLERANCE             3
 
+/***
+ * Mains PLL: the zerocross is estimated from the accepted irqs, a late or noisy irq
+ * moves it only by 1/2^KP_SHIFT of its error, the period follows by 1/2^KI_SHIFT.
+ * Locked after LOCK_COUNT irqs close to the prediction, without irqs it goes on
+ * with the predicted zerocrosses for COAST half phases.
+***/
+#define KTRIAC_PLL_KP_SHIFT             3
+#define KTRIAC_PLL_KI_SHIFT             6
+#define KTRIAC_PLL_LOCK_COUNT           16
+#define KTRIAC_PLL_COAST                8
+
+/***
+ * Mains frequency measurement: the half period is the trimmed mean (the middle half)
+ * of the last 2^FREQ_SHIFT accepted irqs, the gate delays, the latency and the tolerance
+ * range follow it. It may drift FREQ_DRIFT % from the nominal 50/60Hz, irqs further
+ * are not measured, until the PLL locks they are accepted in this range.
+ * The detection at loading accepts FREQ_MIN-FREQ_MAX Hz.
+***/
+#define KTRIAC_FREQ_SHIFT               4
+#define KTRIAC_FREQ_DRIFT               10
+#define KTRIAC_FREQ_MIN                 45
+#define KTRIAC_FREQ_MAX                 65
+//drift rate measured over seconds
+#define KTRIAC_FREQ_DRIFT_TIME          10
+
+/***
+ * Dual edge mode (dual_edge module parameter): the zerocross is the middle of the low
+ * pulse of the detection circuit. After LEARN pulses a pulse differing from the average
+ * width by more than WIDTH_TOLERANCE % is rejected, after LEARN rejected ones in a row
+ * the average is learned again. The average follows by 1/2^WIDTH_SHIFT of the difference.
+***/
+#define KTRIAC_WIDTH_LEARN              16
+#define KTRIAC_WIDTH_TOLERANCE          50
+#define KTRIAC_WIDTH_SHIFT              4
+
+/***
+ * Three phase mode (three_phase module parameter): channel N is on phase L(N % 3 + 1),
+ * the zerocross input is L1. L2 crosses 120 deg, L3 240 deg after it, the channels of a
+ * phase fire from its own zerocross. With the phase_gpios inputs the offsets are measured,
+ * they follow by 1/2^PHASE_SHIFT of the error. An edge of L2 at the place of L3 (or back)
+ * in PHASE_CHECK half phases in a row is a reversed sequence, a phase without edges for
+ * PHASE_LOST half phases is lost: either stops every channel until PHASE_CHECK good edges.
+***/
+#define KTRIAC_PHASE_SHIFT              3
+#define KTRIAC_PHASE_CHECK              8
+#define KTRIAC_PHASE_LOST               4
+
+/***
+ * Load group: the burst and pwm channels with a rated load (in W) share one supply. At every
+ * zerocross the channels due to conduct are switched on in the order of how far behind their
+ * duty they are, as long as the total stays within the limit of the group: the larger of its
+ * average power and its largest load at first. A due channel waits at most GROUP_DELAY times
+ * its mean spacing, its long run duty stays exact. If one goes over the limit that way, the
+ * total is the limit from then on.
+***/
+#define KTRIAC_GROUP_DELAY              2
+
 //If your detection circuit detects with some -/+ latency
 #define ZEROCROSS_DEFAULT_LATENCY        800
+//the latency in us stays within -/+ this: below a half phase of KTRIAC_FREQ_MAX
+#define KTRIAC_LATENCY_MAX               ( 1000000 / 2 / KTRIAC_FREQ_MAX)
 
 //100us fire time to be sure that te triac gets on
 #define TRIAC_DEFAULT_FIRE_TIME                 100 * 1000
+//longest gate pulse in us: a half phase of KTRIAC_FREQ_MAX
+#define KTRIAC_FIRE_TIME_MAX                    ( 1000000 / 2 / KTRIAC_FREQ_MAX)
+
+/***
+ * Gate events of different channels closer than this (in ns) to each other are
+ * handled in the same timer interrupt. The later events will be served up to this much early.
+***/
+#define TRIAC_DEFAULT_MERGE_WINDOW              20 * 1000
+
+/***
+ * Tachometer: pulses closer than GLITCH (ns) to the last one are noise,
+ * without pulses for TIMEOUT (ns) the motor is standing.
+***/
+#define KTRIAC_TACHO_GLITCH             100 * 1000
+#define KTRIAC_TACHO_TIMEOUT            2000LL * 1000 * 1000
 
+/***
+ * Calibration on the load current sense input (high while the load conducts): the channel
+ * fires at 90 deg in every second half phase. The latency comes from where the conduction
+ * ends (the real zerocross of a resistive load) in CALIB_HALF_PHASES of them, then the gate
+ * pulse grows from CALIB_FIRE_MIN (ns) by 1/4 until the load conducted in CALIB_HALF_PHASES
+ * half phases in a row, up to CALIB_FIRE_MAX. The result is this pulse + CALIB_MARGIN %.
+***/
+#define KTRIAC_CALIB_HALF_PHASES        32
+#define KTRIAC_CALIB_FIRE_MIN           5 * 1000
+#define KTRIAC_CALIB_FIRE_MAX           1000 * 1000
+#define KTRIAC_CALIB_MARGIN             50
 
-//Enable /dev/ktriac to debug zerocrossing signals
+//SCHED_FIFO priority of the zerocross irq thread (threaded=1), above the default 50 of irq threads
+#define KTRIAC_IRQ_PRIORITY             80
+
+
+//Enable the event ring of /dev/ktriac to debug zerocrossing signals
 #define DEBUG_DEVICE                    1
+
+//Number of events kept in the /dev/ktriac ring, must be a power of 2
+#define KTRIAC_RING_SIZE                4096
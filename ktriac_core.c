@@ -0,0 +1,2248 @@
+/*********************************************
+*** Linux kernel module to drive TRIAC with
+*** Raspberry Pi
+***
+*** Timing core, see ktriac_core.h
+***
+*** Written by The TunguZka Team Hungary
+*** GNU GPLv3 license
+*********************************************/
+
+#include "ktriac_core.h"
+
+#ifdef __KERNEL__
+    #define CREATE_TRACE_POINTS
+    #include "ktriac_trace.h"
+#endif
+
+
+const int angle_to_percent_table[ 181] = { 100, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 98, 98, 98, 98, 98, 97, 97, 97, 96, 96, 96, 96, 95, 95, 94, 94, 94, 93, 93, 92, 92, 91, 91, 90, 90, 89, 89, 88, 88, 87, 87, 86, 85, 85, 84, 84, 83, 82, 82, 81, 80, 80, 79, 78, 77, 77, 76, 75, 75, 74, 73, 72, 71, 71, 70, 69, 68, 67, 67, 66, 65, 64, 63, 62, 62, 61, 60, 59, 58, 57, 56, 56, 55, 54, 53, 52, 51, 50, 50, 49, 48, 47, 46, 45, 44, 43, 43, 42, 41, 40, 39, 38, 37, 37, 36, 35, 34, 33, 32, 32, 31, 30, 29, 28, 28, 27, 26, 25, 25, 24, 23, 22, 22, 21, 20, 19, 19, 18, 17, 17, 16, 15, 15, 14, 14, 13, 12, 12, 11, 11, 10, 10, 9, 9, 8, 8, 7, 7, 6, 6, 5, 5, 5, 4, 4, 3, 3, 3, 3, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0};
+
+//power -> gate position in 1/65536 of the half phase for a resistive load:
+//the inverse of P(a) = 1 - a/pi + sin(2a)/(2pi)
+const u16 default_power_curve[ KTRIAC_POWER_STEPS + 1] = {
+    65535, 62032, 61116, 60472, 59958, 59522, 59141, 58799, 58488, 58201, 57934, 57684, 57448, 57225, 57012, 56809,
+    56615, 56428, 56248, 56075, 55907, 55744, 55586, 55433, 55284, 55139, 54997, 54859, 54724, 54592, 54462, 54336,
+    54212, 54090, 53971, 53854, 53739, 53625, 53514, 53405, 53297, 53191, 53086, 52983, 52882, 52782, 52683, 52585,
+    52489, 52394, 52300, 52208, 52116, 52026, 51936, 51848, 51760, 51673, 51588, 51503, 51419, 51336, 51253, 51172,
+    51091, 51011, 50932, 50853, 50775, 50698, 50621, 50546, 50470, 50396, 50321, 50248, 50175, 50103, 50031, 49960,
+    49889, 49818, 49749, 49679, 49611, 49542, 49475, 49407, 49340, 49274, 49208, 49142, 49077, 49012, 48947, 48883,
+    48819, 48756, 48693, 48631, 48568, 48506, 48445, 48384, 48323, 48262, 48202, 48142, 48083, 48023, 47964, 47906,
+    47847, 47789, 47731, 47674, 47616, 47559, 47503, 47446, 47390, 47334, 47278, 47223, 47167, 47112, 47058, 47003,
+    46949, 46895, 46841, 46787, 46734, 46681, 46628, 46575, 46522, 46470, 46418, 46366, 46314, 46263, 46211, 46160,
+    46109, 46058, 46008, 45957, 45907, 45857, 45807, 45757, 45708, 45658, 45609, 45560, 45511, 45462, 45414, 45365,
+    45317, 45269, 45221, 45173, 45125, 45078, 45030, 44983, 44936, 44889, 44842, 44796, 44749, 44703, 44656, 44610,
+    44564, 44518, 44472, 44427, 44381, 44336, 44291, 44245, 44200, 44155, 44111, 44066, 44021, 43977, 43933, 43888,
+    43844, 43800, 43756, 43713, 43669, 43625, 43582, 43538, 43495, 43452, 43409, 43366, 43323, 43280, 43238, 43195,
+    43153, 43110, 43068, 43026, 42983, 42941, 42900, 42858, 42816, 42774, 42733, 42691, 42650, 42608, 42567, 42526,
+    42485, 42444, 42403, 42362, 42321, 42281, 42240, 42199, 42159, 42119, 42078, 42038, 41998, 41958, 41918, 41878,
+    41838, 41798, 41758, 41719, 41679, 41640, 41600, 41561, 41522, 41482, 41443, 41404, 41365, 41326, 41287, 41248,
+    41209, 41171, 41132, 41093, 41055, 41016, 40978, 40939, 40901, 40863, 40824, 40786, 40748, 40710, 40672, 40634,
+    40596, 40559, 40521, 40483, 40445, 40408, 40370, 40333, 40295, 40258, 40220, 40183, 40146, 40109, 40072, 40034,
+    39997, 39960, 39923, 39886, 39850, 39813, 39776, 39739, 39703, 39666, 39629, 39593, 39556, 39520, 39483, 39447,
+    39411, 39374, 39338, 39302, 39266, 39229, 39193, 39157, 39121, 39085, 39049, 39013, 38977, 38942, 38906, 38870,
+    38834, 38799, 38763, 38727, 38692, 38656, 38621, 38585, 38550, 38514, 38479, 38444, 38408, 38373, 38338, 38303,
+    38268, 38232, 38197, 38162, 38127, 38092, 38057, 38022, 37987, 37952, 37918, 37883, 37848, 37813, 37778, 37744,
+    37709, 37674, 37640, 37605, 37571, 37536, 37501, 37467, 37432, 37398, 37364, 37329, 37295, 37260, 37226, 37192,
+    37158, 37123, 37089, 37055, 37021, 36987, 36952, 36918, 36884, 36850, 36816, 36782, 36748, 36714, 36680, 36646,
+    36612, 36578, 36545, 36511, 36477, 36443, 36409, 36375, 36342, 36308, 36274, 36241, 36207, 36173, 36140, 36106,
+    36072, 36039, 36005, 35972, 35938, 35904, 35871, 35837, 35804, 35771, 35737, 35704, 35670, 35637, 35603, 35570,
+    35537, 35503, 35470, 35437, 35403, 35370, 35337, 35304, 35270, 35237, 35204, 35171, 35137, 35104, 35071, 35038,
+    35005, 34972, 34939, 34905, 34872, 34839, 34806, 34773, 34740, 34707, 34674, 34641, 34608, 34575, 34542, 34509,
+    34476, 34443, 34410, 34377, 34344, 34311, 34278, 34245, 34212, 34179, 34146, 34113, 34080, 34048, 34015, 33982,
+    33949, 33916, 33883, 33850, 33817, 33785, 33752, 33719, 33686, 33653, 33620, 33588, 33555, 33522, 33489, 33456,
+    33424, 33391, 33358, 33325, 33292, 33260, 33227, 33194, 33161, 33128, 33096, 33063, 33030, 32997, 32965, 32932,
+    32899, 32866, 32834, 32801, 32768, 32735, 32702, 32670, 32637, 32604, 32571, 32539, 32506, 32473, 32440, 32408,
+    32375, 32342, 32309, 32276, 32244, 32211, 32178, 32145, 32112, 32080, 32047, 32014, 31981, 31948, 31916, 31883,
+    31850, 31817, 31784, 31751, 31719, 31686, 31653, 31620, 31587, 31554, 31521, 31488, 31456, 31423, 31390, 31357,
+    31324, 31291, 31258, 31225, 31192, 31159, 31126, 31093, 31060, 31027, 30994, 30961, 30928, 30895, 30862, 30829,
+    30796, 30763, 30730, 30697, 30664, 30631, 30597, 30564, 30531, 30498, 30465, 30432, 30399, 30365, 30332, 30299,
+    30266, 30232, 30199, 30166, 30133, 30099, 30066, 30033, 29999, 29966, 29933, 29899, 29866, 29832, 29799, 29765,
+    29732, 29699, 29665, 29632, 29598, 29564, 29531, 29497, 29464, 29430, 29396, 29363, 29329, 29295, 29262, 29228,
+    29194, 29161, 29127, 29093, 29059, 29025, 28991, 28958, 28924, 28890, 28856, 28822, 28788, 28754, 28720, 28686,
+    28652, 28618, 28584, 28549, 28515, 28481, 28447, 28413, 28378, 28344, 28310, 28276, 28241, 28207, 28172, 28138,
+    28104, 28069, 28035, 28000, 27965, 27931, 27896, 27862, 27827, 27792, 27758, 27723, 27688, 27653, 27618, 27584,
+    27549, 27514, 27479, 27444, 27409, 27374, 27339, 27304, 27268, 27233, 27198, 27163, 27128, 27092, 27057, 27022,
+    26986, 26951, 26915, 26880, 26844, 26809, 26773, 26737, 26702, 26666, 26630, 26594, 26559, 26523, 26487, 26451,
+    26415, 26379, 26343, 26307, 26270, 26234, 26198, 26162, 26125, 26089, 26053, 26016, 25980, 25943, 25907, 25870,
+    25833, 25797, 25760, 25723, 25686, 25650, 25613, 25576, 25539, 25502, 25464, 25427, 25390, 25353, 25316, 25278,
+    25241, 25203, 25166, 25128, 25091, 25053, 25015, 24977, 24940, 24902, 24864, 24826, 24788, 24750, 24712, 24673,
+    24635, 24597, 24558, 24520, 24481, 24443, 24404, 24365, 24327, 24288, 24249, 24210, 24171, 24132, 24093, 24054,
+    24014, 23975, 23936, 23896, 23857, 23817, 23778, 23738, 23698, 23658, 23618, 23578, 23538, 23498, 23458, 23417,
+    23377, 23337, 23296, 23255, 23215, 23174, 23133, 23092, 23051, 23010, 22969, 22928, 22886, 22845, 22803, 22762,
+    22720, 22678, 22636, 22595, 22553, 22510, 22468, 22426, 22383, 22341, 22298, 22256, 22213, 22170, 22127, 22084,
+    22041, 21998, 21954, 21911, 21867, 21823, 21780, 21736, 21692, 21648, 21603, 21559, 21515, 21470, 21425, 21381,
+    21336, 21291, 21245, 21200, 21155, 21109, 21064, 21018, 20972, 20926, 20880, 20833, 20787, 20740, 20694, 20647,
+    20600, 20553, 20506, 20458, 20411, 20363, 20315, 20267, 20219, 20171, 20122, 20074, 20025, 19976, 19927, 19878,
+    19828, 19779, 19729, 19679, 19629, 19579, 19528, 19478, 19427, 19376, 19325, 19273, 19222, 19170, 19118, 19066,
+    19014, 18961, 18908, 18855, 18802, 18749, 18695, 18641, 18587, 18533, 18478, 18424, 18369, 18313, 18258, 18202,
+    18146, 18090, 18033, 17977, 17920, 17862, 17805, 17747, 17689, 17630, 17572, 17513, 17453, 17394, 17334, 17274,
+    17213, 17152, 17091, 17030, 16968, 16905, 16843, 16780, 16717, 16653, 16589, 16524, 16459, 16394, 16328, 16262,
+    16196, 16129, 16061, 15994, 15925, 15857, 15787, 15718, 15647, 15576, 15505, 15433, 15361, 15288, 15215, 15140,
+    15066, 14990, 14915, 14838, 14761, 14683, 14604, 14525, 14445, 14364, 14283, 14200, 14117, 14033, 13948, 13863,
+    13776, 13688, 13600, 13510, 13420, 13328, 13236, 13142, 13047, 12951, 12853, 12754, 12654, 12553, 12450, 12345,
+    12239, 12131, 12022, 11911, 11797, 11682, 11565, 11446, 11324, 11200, 11074, 10944, 10812, 10677, 10539, 10397,
+    10252, 10103, 9950, 9792, 9629, 9461, 9288, 9108, 8921, 8727, 8524, 8311, 8088, 7852, 7602, 7335,
+    7048, 6737, 6395, 6014, 5578, 5064, 4420, 3504, 0
+};
+
+//conducted part of the sine energy of a half phase fired at i / KTRIAC_ENERGY_STEPS
+//of it, in 1/65536 for a resistive load: P(a) = 1 - a/pi + sin(2a)/(2pi)
+const u32 energy_curve[ KTRIAC_ENERGY_STEPS + 1] = {
+    65536, 65536, 65536, 65535, 65534, 65533, 65530, 65527, 65523, 65517, 65510, 65502, 65492, 65480, 65466, 65450,
+    65432, 65411, 65388, 65362, 65333, 65301, 65266, 65228, 65187, 65142, 65093, 65041, 64985, 64925, 64861, 64792,
+    64719, 64642, 64560, 64474, 64383, 64287, 64186, 64080, 63969, 63852, 63730, 63603, 63471, 63333, 63189, 63040,
+    62884, 62723, 62557, 62384, 62205, 62021, 61830, 61633, 61430, 61221, 61005, 60784, 60556, 60322, 60082, 59835,
+    59582, 59323, 59058, 58786, 58508, 58224, 57933, 57637, 57334, 57025, 56710, 56389, 56061, 55728, 55389, 55043,
+    54692, 54336, 53973, 53605, 53231, 52851, 52466, 52076, 51681, 51280, 50874, 50463, 50047, 49626, 49200, 48770,
+    48335, 47896, 47453, 47005, 46553, 46097, 45637, 45174, 44707, 44236, 43762, 43285, 42805, 42322, 41836, 41347,
+    40856, 40362, 39866, 39368, 38868, 38366, 37862, 37357, 36851, 36343, 35834, 35325, 34814, 34303, 33792, 33280,
+    32768, 32256, 31744, 31233, 30722, 30211, 29702, 29193, 28685, 28179, 27674, 27170, 26668, 26168, 25670, 25174,
+    24680, 24189, 23700, 23214, 22731, 22251, 21774, 21300, 20829, 20362, 19899, 19439, 18983, 18531, 18083, 17640,
+    17201, 16766, 16336, 15910, 15489, 15073, 14662, 14256, 13855, 13460, 13070, 12685, 12305, 11931, 11563, 11200,
+    10844, 10493, 10147, 9808, 9475, 9147, 8826, 8511, 8202, 7899, 7603, 7312, 7028, 6750, 6478, 6213,
+    5954, 5701, 5454, 5214, 4980, 4752, 4531, 4315, 4106, 3903, 3706, 3515, 3331, 3152, 2979, 2813,
+    2652, 2496, 2347, 2203, 2065, 1933, 1806, 1684, 1567, 1456, 1350, 1249, 1153, 1062, 976, 894,
+    817, 744, 675, 611, 551, 495, 443, 394, 349, 308, 270, 235, 203, 174, 148, 125,
+    104, 86, 70, 56, 44, 34, 26, 19, 13, 9, 6, 3, 2, 1, 0, 0,
+    0
+};
+
+
+/*
+ * Duration of the half phase in ns
+ */
+static inline u32 half_phase_ns( unsigned int ac_freq)
+{
+    return 1000000000U / ( ac_freq * 2);
+}
+
+/*
+ * Time from the zerocross to the attack angle in ns, a multiply by the angleScale of set_ac_frequent
+ */
+static inline s64 angle_to_delay( const struct ktriac_settings *cfg, int angle_deg)
+{
+    return ( (u64)angle_deg * cfg->angleScale) >> 16;
+}
+
+/*
+ * Gate delays of every power step for the frequency and the curve of cfg,
+ * the channels get the delays of the new table.
+ */
+static void power_table_build( struct ktriac_settings *cfg)
+{
+    u32 halfPhase = half_phase_ns( cfg->ac_freq);
+    unsigned int i;
+
+    for ( i = 0; i <= KTRIAC_POWER_STEPS; ++i)
+        cfg->powerDelay[ i] = ( (u64)halfPhase * cfg->powerCurve[ i]) >> 16;
+
+    for ( i = 0; i < KTRIAC_MAX_CHANNELS; ++i)
+    {
+        struct triac_setting *set = &cfg->channel[ i];
+
+        if ( set->power > 0)
+            set->triggerDelay = cfg->powerDelay[ set->power];
+        else
+        if ( set->angle > 0)
+            set->triggerDelay = angle_to_delay( cfg, set->angle);
+    }
+}
+
+/*
+ * Report an event if the platform wants them
+ */
+static void core_emit( struct ktriac_core *core, unsigned int type, unsigned int reason, unsigned int channel,
+                       s64 timestamp, s64 fire, s64 release, unsigned int data)
+{
+    struct ktriac_event event;
+
+    if ( !core->hw->emit)
+        return;
+
+    event.timestamp = timestamp;
+    event.fire = fire;
+    event.release = release;
+    event.data = data;
+    event.type = type;
+    event.channel = channel;
+    event.reason = reason;
+
+    core->hw->emit( core->ctx, &event);
+}
+
+/*
+ * Drop the already handled events and move the pending ones
+ * (fired late in the last half phase) to the front of the schedule.
+ */
+static void schedule_compact( struct ktriac_core *core)
+{
+    unsigned int i, n = 0;
+
+    //the zerocross has come, its coast event is not needed any more
+    for ( i = core->scheduleNext; i < core->scheduleLen; ++i)
+        if ( core->schedule[ i].action != COAST)
+            core->schedule[ n++] = core->schedule[ i];
+
+    core->scheduleLen = n;
+    core->scheduleNext = 0;
+}
+
+/*
+ * Insert an event keeping the schedule sorted by time,
+ * events with the same time keep their insertion order.
+ */
+static void schedule_add( struct ktriac_core *core, s64 time, unsigned int channel, unsigned int action)
+{
+    struct triac_event *schedule = core->schedule;
+    unsigned int i = core->scheduleLen;
+
+    while ( i > core->scheduleNext && schedule[ i - 1].time > time)
+    {
+        schedule[ i] = schedule[ i - 1];
+        --i;
+    }
+
+    schedule[ i].time = time;
+    schedule[ i].channel = channel;
+    schedule[ i].action = action;
+    ++core->scheduleLen;
+}
+
+/*
+ * Schedule a gate pulse of the channel starting at fire
+ */
+static void channel_fire_at( struct ktriac_core *core, unsigned int index, s64 fire)
+{
+    s64 fireTime = core->settings->channel[ index].fireTime;
+
+    if ( core->scheduleLen + 2 > SCHEDULE_SIZE)
+    {
+        ++core->scheduleOverruns;
+        return;
+    }
+
+    //the calibration tries longer and longer gate pulses
+    if ( core->calib.state == CALIB_FIRE && core->calib.channel == index)
+        fireTime = core->calib.fireTime;
+
+    schedule_add( core, fire, index, ON);
+    schedule_add( core, fire + fireTime, index, OFF);
+}
+
+/*
+ * The gate of the channel fired at now: sum the energy conducted from there to the
+ * end of the real half phase. A pulse reaching over the zerocross fires the next
+ * half phase from its start.
+ */
+static void channel_energy( struct ktriac_core *core, unsigned int index, s64 now)
+{
+    struct triac_channel *ch = &core->channels[ index];
+    s64 period = core->freqPeriod;
+    s64 phase = now - core->lastZerocross - core->freqLatency - core->phases[ core->settings->channel[ index].phase].offset;
+    unsigned int position, i;
+    u32 energy;
+
+    if ( period <= 0)
+        return;
+
+    while ( phase < 0)
+        phase += period;
+    while ( phase >= period)
+        phase -= period;
+
+    if ( phase + core->settings->channel[ index].fireTime >= period)
+        phase = 0;
+
+    position = ( phase * core->freqInverse) >> 32;
+    if ( position >= 1 << 16)
+        position = ( 1 << 16) - 1;
+    i = position >> 8;
+    energy = energy_curve[ i] - ( ( ( energy_curve[ i] - energy_curve[ i + 1]) * ( position & 255)) >> 8);
+
+    ch->energy += ( (u64)period * energy) >> 16;
+    ++ch->conducted;
+}
+
+/*
+ * Next half phase of a running ramp: takes the next step when its time has come.
+ * The time goes by the measured half period, the ramp follows the real mains and its drift.
+ */
+static void channel_ramp( struct ktriac_core *core, unsigned int index)
+{
+    struct triac_channel *ch = &core->channels[ index];
+    const struct ramp_segment *seg = &core->settings->ramps[ index][ ch->rampSegment];
+
+    ch->rampTime -= core->freqPeriod;
+    if ( ch->rampTime > 0)
+        return;
+
+    ++ch->rampStep;
+
+    if ( ch->rampStep >= seg->steps)
+        ch->rampPercent = seg->to;
+    else
+        ch->rampPercent = ( seg->from * 256 + seg->inc * (int)ch->rampStep) / 256;
+
+    ch->rampDelay = core->settings->powerDelay[ ch->rampPercent * ( KTRIAC_POWER_STEPS / 100)];
+    ch->rampAngle = ( ch->rampPercent == 0) ? -1 : ( ch->rampDelay == 0) ? 0 : 1;
+
+    //at most one step in a half phase, a shorter step time does not pile up
+    ch->rampTime += seg->stepTime;
+    if ( ch->rampTime < 0)
+        ch->rampTime = 0;
+
+    if ( ch->rampStep < seg->steps)
+        return;
+
+    //segment done, the settings hold the end of the last one
+    if ( ++ch->rampSegment >= core->settings->channel[ index].rampCount)
+    {
+        ch->rampActive = 0;
+        return;
+    }
+
+    ch->rampStep = core->settings->ramps[ index][ ch->rampSegment].startStep;
+}
+
+/*
+ * The playing buffer of the waveform is done: go on with the next one if it is
+ * written already, replay it in loop mode, or stop.
+ */
+static void wave_next( struct ktriac_core *core, struct wave_player *wave)
+{
+    struct wave_buffer *buf = &wave->buffer[ wave->playing];
+    struct wave_buffer *next = &wave->buffer[ wave->playing ^ 1];
+
+    unsigned int ready = ( smp_load_acquire( &next->state) == WAVE_READY);
+
+    wave->position = 0;
+
+    if ( !ready && ( buf->flags & KTRIAC_WAVE_LOOP))
+        return;
+
+    if ( ready)
+        next->state = WAVE_PLAYING;
+    else
+    {
+        wave->active = 0;
+        if ( !( buf->flags & KTRIAC_WAVE_LAST))
+            ++wave->underruns;
+    }
+
+    wave->playing ^= 1;
+    smp_store_release( &buf->state, WAVE_FREE);
+    ++core->waveFreed;
+}
+
+/*
+ * Next entry of the waveform of the channel if it plays one:
+ * sets angle & triggerDelay like a ramp does, returns 0 if it does not play.
+ */
+static unsigned int channel_wave( struct ktriac_core *core, unsigned int index, unsigned int coast,
+                                  int *angle, s64 *triggerDelay)
+{
+    struct wave_player *wave = &core->wave[ index];
+    struct wave_buffer *buf = &wave->buffer[ wave->playing];
+    struct ktriac_wave_entry entry;
+
+    if ( !wave->active)
+    {
+        if ( smp_load_acquire( &buf->state) != WAVE_READY)
+            return 0;
+
+        buf->state = WAVE_PLAYING;
+        wave->active = 1;
+        wave->position = 0;
+    }
+
+    //one entry for every real zerocross
+    if ( coast)
+    {
+        *angle = -1;
+        return 1;
+    }
+
+    entry = buf->entry[ wave->position];
+    ++wave->played;
+
+    if ( ++wave->position >= buf->count)
+        wave_next( core, wave);
+
+    *angle = -1;
+
+    if ( entry.type == KTRIAC_WAVE_ANGLE && entry.value < 180)
+    {
+        *angle = entry.value;
+        *triggerDelay = angle_to_delay( core->settings, entry.value);
+    }
+    else
+    if ( entry.type == KTRIAC_WAVE_POWER && entry.value > 0)
+    {
+        *triggerDelay = core->settings->powerDelay[ entry.value];
+        *angle = ( *triggerDelay == 0) ? 0 : 1;
+    }
+
+    return 1;
+}
+
+/*
+ * Setpoint of the channel in the control page, sampled at every zerocross: taken if its
+ * sequence is even, changed and the same after reading it. Sets angle & triggerDelay
+ * like a waveform does, returns 0 if no setpoint is set.
+ */
+static unsigned int channel_setpoint( struct ktriac_core *core, unsigned int index, int *angle, s64 *triggerDelay)
+{
+    struct triac_channel *ch = &core->channels[ index];
+    const struct ktriac_setpoint *slot;
+    unsigned int sequence, type;
+    int value;
+
+    if ( !core->setpoints)
+        return 0;
+
+    slot = &core->setpoints[ index];
+    sequence = smp_load_acquire( &slot->sequence);
+
+    //being written: the last one for this half phase
+    if ( !( sequence & 1) && sequence != ch->setpointSeq)
+    {
+        type = READ_ONCE( slot->type);
+        value = READ_ONCE( slot->value);
+        smp_rmb();
+
+        if ( READ_ONCE( slot->sequence) == sequence)
+        {
+            ch->setpointSeq = sequence;
+            ch->setpointType = type;
+            ch->setpointValue = value;
+
+            if ( type == KTRIAC_SETPOINT_ANGLE)
+            {
+                ch->setpointValue = clamp( value, 0, 180);
+                ch->setpointDuty = angle_to_percent_table[ ch->setpointValue];
+            }
+            else
+            if ( type == KTRIAC_SETPOINT_POWER)
+            {
+                ch->setpointValue = clamp( value, 0, KTRIAC_POWER_STEPS);
+                ch->setpointDuty = ( ch->setpointValue + 5) / ( KTRIAC_POWER_STEPS / 100);
+            }
+            else
+                ch->setpointType = KTRIAC_SETPOINT_NONE;
+        }
+    }
+
+    *angle = -1;
+
+    if ( ch->setpointType == KTRIAC_SETPOINT_ANGLE && ch->setpointValue < 180)
+    {
+        *angle = ch->setpointValue;
+        *triggerDelay = angle_to_delay( core->settings, ch->setpointValue);
+    }
+    else
+    if ( ch->setpointType == KTRIAC_SETPOINT_POWER && ch->setpointValue > 0)
+    {
+        *triggerDelay = core->settings->powerDelay[ ch->setpointValue];
+        *angle = ( *triggerDelay == 0) ? 0 : 1;
+    }
+
+    return ( ch->setpointType != KTRIAC_SETPOINT_NONE);
+}
+
+/*
+ * The power of the speed control if it drives the channel, returns 0 if not
+ */
+static unsigned int channel_speed( struct ktriac_core *core, unsigned int index, int *angle, s64 *triggerDelay)
+{
+    const struct speed_setting *speed = &core->settings->speed;
+
+    if ( speed->config.channel != (int)index)
+        return 0;
+
+    *triggerDelay = core->settings->powerDelay[ core->speed.output];
+    *angle = ( core->speed.output == 0) ? -1 : ( *triggerDelay == 0) ? 0 : 1;
+
+    return 1;
+}
+
+/*
+ * Start or stop the calibration as the settings say
+ */
+static void calib_update( struct ktriac_core *core)
+{
+    struct calibration *cal = &core->calib;
+    int channel = core->settings->calibChannel;
+
+    if ( core->settings->calibStart == cal->start)
+        return;
+
+    cal->start = core->settings->calibStart;
+
+    if ( channel < 0 || channel >= (int)core->channelCount)
+    {
+        if ( cal->state == CALIB_LATENCY || cal->state == CALIB_FIRE)
+            cal->state = CALIB_OFF;
+        return;
+    }
+
+    cal->state = CALIB_LATENCY;
+    cal->channel = channel;
+    cal->planned = 0;
+    cal->fireZc = 0;
+    cal->count = cal->good = 0;
+    cal->sum = cal->min = cal->max = 0;
+}
+
+/*
+ * The fired half phase of the calibration is over: take its sample,
+ * go to the next step if the current one is done
+ */
+static void calib_evaluate( struct ktriac_core *core)
+{
+    struct calibration *cal = &core->calib;
+    s64 sample;
+
+    ++cal->count;
+
+    if ( cal->state == CALIB_LATENCY && cal->ended)
+    {
+        //the conduction ended at the real zerocross after the fired half phase
+        sample = cal->endAt - cal->fireZc - core->freqPeriod;
+
+        if ( !cal->good || sample < cal->min)
+            cal->min = sample;
+        if ( !cal->good || sample > cal->max)
+            cal->max = sample;
+        cal->sum += sample;
+        ++cal->good;
+    }
+    else
+    if ( cal->state == CALIB_FIRE && cal->conducted)
+        ++cal->good;
+
+    if ( cal->count < KTRIAC_CALIB_HALF_PHASES)
+        return;
+
+    if ( cal->state == CALIB_LATENCY)
+    {
+        //the load has to conduct with the gate pulse of the settings
+        if ( cal->good < KTRIAC_CALIB_HALF_PHASES / 2)
+        {
+            cal->state = CALIB_FAILED;
+            core->reports |= REPORT_CALIBRATED;
+            return;
+        }
+
+        //the mean without the extremes; past half of the period it is the next zerocross,
+        //given from the end of the half phase like a negative setting
+        sample = div_s64( cal->sum - cal->min - cal->max, cal->good - 2);
+        if ( sample * 2 > core->freqPeriod)
+            sample -= core->freqPeriod;
+
+        cal->latency = div_s64( sample, 1000);
+        cal->state = CALIB_FIRE;
+        cal->fireTime = KTRIAC_CALIB_FIRE_MIN;
+    }
+    else
+    if ( cal->good == cal->count)
+    {
+        cal->fireResult = div_s64( cal->fireTime * ( 100 + KTRIAC_CALIB_MARGIN), 100);
+        cal->state = CALIB_DONE;
+        core->reports |= REPORT_CALIBRATED;
+        return;
+    }
+    else
+    if ( ( cal->fireTime += cal->fireTime >> 2) > KTRIAC_CALIB_FIRE_MAX)
+    {
+        cal->state = CALIB_FAILED;
+        core->reports |= REPORT_CALIBRATED;
+        return;
+    }
+
+    cal->count = cal->good = 0;
+}
+
+/*
+ * The calibration drives the channel: fires at 90 deg in every second half phase,
+ * returns 0 if it does not run on the channel
+ */
+static unsigned int channel_calib( struct ktriac_core *core, unsigned int index, s64 now, int *angle, s64 *triggerDelay)
+{
+    struct calibration *cal = &core->calib;
+
+    if ( cal->channel != index || ( cal->state != CALIB_LATENCY && cal->state != CALIB_FIRE))
+        return 0;
+
+    //the half phase after the fired one: wait for the end of the conduction
+    if ( cal->planned == 2)
+    {
+        cal->planned = 1;
+        *angle = -1;
+        return 1;
+    }
+
+    if ( cal->fireZc)
+        calib_evaluate( core);
+
+    if ( cal->state != CALIB_LATENCY && cal->state != CALIB_FIRE)
+        return 0;
+
+    cal->planned = 2;
+    cal->conducted = cal->ended = 0;
+    cal->fireZc = now;
+    *angle = 1;
+    *triggerDelay = angle_to_delay( core->settings, 90);
+
+    return 1;
+}
+
+/*
+ * Gate delay of the settings scaled to the measured half phase
+ */
+static inline s64 freq_delay( struct ktriac_core *core, s64 delay)
+{
+    return ( delay * core->freqScale) >> 16;
+}
+
+/*
+ * Angle mode: fire at fire, keep the gate on (angle 0) or off (angle < 0)
+ */
+static void channel_angle( struct ktriac_core *core, unsigned int index, int angle, s64 fire)
+{
+    struct triac_channel *ch = &core->channels[ index];
+
+    if ( angle > 0)
+        channel_fire_at( core, index, fire);
+    else
+    if ( angle < 0 && is_triac_on( ch))
+        triac( core, index, OFF);
+    else
+    if ( angle == 0)
+    {
+        if ( !is_triac_on( ch))
+            triac( core, index, ON);
+
+        //the gate is kept on: the whole half phase conducts
+        ch->energy += core->freqPeriod;
+        ++ch->conducted;
+    }
+}
+
+/*
+ * Duty of a load group member: num of every den decisions, a full cycle burst
+ * decides once a cycle. 0 if the channel is not in the group.
+ */
+static inline unsigned int group_duty( const struct triac_setting *set, unsigned int *num, unsigned int *den)
+{
+    if ( !set->load)
+        return 0;
+
+    if ( set->burst)
+    {
+        *num = set->burstNum;
+        *den = set->burstDen;
+        return 1;
+    }
+
+    if ( set->mark)
+    {
+        *num = set->mark;
+        *den = set->mark + set->space;
+        return 1;
+    }
+
+    return 0;
+}
+
+//the calibration, a playing waveform, a setpoint or the speed control drives the channel
+static inline unsigned int channel_override( const struct ktriac_core *core, unsigned int index)
+{
+    return ( core->wave[ index].active || core->channels[ index].setpointType != KTRIAC_SETPOINT_NONE ||
+             core->settings->speed.config.channel == (int)index ||
+             ( core->calib.channel == index && ( core->calib.state == CALIB_LATENCY || core->calib.state == CALIB_FIRE)));
+}
+
+/*
+ * Plan the current half phase of one channel
+ */
+static void channel_zerocross( struct ktriac_core *core, unsigned int index, s64 now, unsigned int coast)
+{
+    struct triac_channel *ch = &core->channels[ index];
+    const struct triac_setting *set = &core->settings->channel[ index];
+    s64 latency = core->freqLatency;
+    int angle = set->angle;
+    s64 triggerDelay = set->triggerDelay;
+
+    ++ch->halfPhases;
+    ch->energyTime += core->freqPeriod;
+
+    //the calibration, a playing waveform, a setpoint or the speed control overrides every mode
+    if ( channel_calib( core, index, now, &angle, &triggerDelay) ||
+         channel_wave( core, index, coast, &angle, &triggerDelay) || channel_setpoint( core, index, &angle, &triggerDelay) ||
+         channel_speed( core, index, &angle, &triggerDelay))
+    {
+        channel_angle( core, index, angle, now + freq_delay( core, triggerDelay) + latency);
+        return;
+    }
+
+    if ( ch->rampActive)
+    {
+        channel_ramp( core, index);
+
+        angle = ch->rampAngle;
+        triggerDelay = ch->rampDelay;
+    }
+
+    //sigma-delta burst: the conducting half phases are spread evenly,
+    //in full cycle mode only the first half phase of a cycle decides
+    if ( set->burst)
+    {
+        //the load group decided already
+        if ( !set->load && ( !set->fullCycle || !ch->counter))
+        {
+            ch->burstAcc += set->burstNum;
+            ch->burstOn = ( ch->burstAcc >= set->burstDen);
+            if ( ch->burstOn)
+                ch->burstAcc -= set->burstDen;
+        }
+
+        ch->counter ^= 1;
+
+        if ( ch->burstOn)
+            channel_fire_at( core, index, now + latency);
+    }
+    else
+    //pwm mode, in the load group like a burst
+    if ( set->mark && set->load)
+    {
+        if ( ch->burstOn)
+            channel_fire_at( core, index, now + latency);
+    }
+    else
+    if ( set->mark)
+    {
+        ++ch->counter;
+        if ( ch->counter <= set->mark)
+            channel_fire_at( core, index, now + latency);
+
+        if ( ch->counter >= set->space + set->mark)
+            ch->counter = 0;
+    }
+    else
+        channel_angle( core, index, angle, now + freq_delay( core, triggerDelay) + latency);
+}
+
+/*
+ * Take over the settings last published, all of them at once
+ */
+static inline void settings_take( struct ktriac_core *core)
+{
+    unsigned int middle;
+
+    if ( !( READ_ONCE( core->settingsMiddle) & SETTINGS_FRESH))
+        return;
+
+    middle = xchg( &core->settingsMiddle, core->settingsFront);
+    core->settingsFront = middle & ~SETTINGS_FRESH;
+    core->settings = &core->settingsBuf[ core->settingsFront];
+}
+
+/*
+ * Derive the tolerance range, the latency and the scale of the gate delays from freqPeriod.
+ * freqInverse follows it with a Newton step, x += x * ( 1 - freqPeriod * x): it is close
+ * already, freqPeriod moves only a little from one zerocross to the next.
+ */
+static void freq_derive( struct ktriac_core *core)
+{
+    const struct ktriac_settings *cfg = core->settings;
+    unsigned int i;
+    s64 error;
+
+    //detecting: anything between KTRIAC_FREQ_MIN and KTRIAC_FREQ_MAX Hz
+    if ( !core->freqNominal)
+    {
+        core->freqLower = half_phase_ns( KTRIAC_FREQ_MAX);
+        core->freqUpper = half_phase_ns( KTRIAC_FREQ_MIN);
+        core->freqWindow = ( core->freqUpper - core->freqLower) >> 1;
+    }
+    else
+    {
+        core->freqWindow = ( core->freqPeriod * cfg->toleranceScale) >> 16;
+        core->freqLower = core->freqPeriod - core->freqWindow;
+        core->freqUpper = core->freqPeriod + core->freqWindow;
+
+        //unlocked: the mains may be anywhere in the drift limit, the measurement has to catch it.
+        //Locked the tolerance range holds, the PLL window gates the early edges then.
+        if ( !core->pllLocked)
+        {
+            if ( core->freqLower > core->freqNominal - core->freqDriftLimit)
+                core->freqLower = core->freqNominal - core->freqDriftLimit;
+            if ( core->freqUpper < core->freqNominal + core->freqDriftLimit)
+                core->freqUpper = core->freqNominal + core->freqDriftLimit;
+        }
+    }
+
+    core->freqScale = ( (u64)core->freqPeriod * cfg->halfPhaseInverse) >> 32;
+
+    if ( !core->freqInverse)
+        core->freqInverse = cfg->halfPhaseInverse;
+    error = ( 1LL << 48) - (s64)( core->freqPeriod * core->freqInverse);
+    core->freqInverse += ( (s64)core->freqInverse * ( error >> 16)) >> 32;
+    core->freqLatency = ( cfg->latencyFromEnd) ? core->freqPeriod + ( cfg->zeroCrossLatency - cfg->halfPhase) * 1000
+                                               : cfg->zeroCrossLatency * 1000;
+
+    //three phase: L2 crosses 2/3, L3 1/3 of a half phase after L1 (120 and 240 deg)
+    core->phases[ 1].expected = ( (u64)core->freqPeriod * 0xAAAAAAABULL) >> 32;
+    core->phases[ 2].expected = ( (u64)core->freqPeriod * 0xAAAAAAABULL) >> 33;
+
+    for ( i = 1; i < KTRIAC_PHASES; ++i)
+        if ( !core->phaseInputs || !core->phases[ i].good)
+            core->phases[ i].offset = core->phases[ i].expected;
+}
+
+/*
+ * Start the measurement again from the frequency of the settings
+ */
+static void freq_reset( struct ktriac_core *core)
+{
+    const struct ktriac_settings *cfg = core->settings;
+
+    core->freqChanged = cfg->freqChanged;
+    core->freqCount = core->freqNext = 0;
+    core->freqDriftFrom = core->freqDriftStart = core->freqDriftEnd = core->freqDriftSpan = 0;
+    core->freqNominal = ( cfg->freqAuto) ? 0 : half_phase_ns( cfg->ac_freq);
+    core->freqPeriod = half_phase_ns( cfg->ac_freq);
+    core->freqInverse = cfg->halfPhaseInverse;
+    core->freqDriftLimit = ( core->freqPeriod * KTRIAC_FREQ_DRIFT_SCALE) >> 16;
+}
+
+/*
+ * An accepted half period of the mains in ns at now: a new trimmed mean
+ * of the window, the frequency is detected at the first full window
+ */
+static void freq_measure( struct ktriac_core *core, s64 period, s64 now)
+{
+    s64 *sorted = core->freqSorted;
+    unsigned int n = core->freqCount;
+    unsigned int i;
+    s64 sum = 0;
+
+    if ( core->freqNominal && ( period < core->freqNominal - core->freqDriftLimit || period > core->freqNominal + core->freqDriftLimit))
+        return;
+
+    //the oldest one leaves the sorted window
+    if ( n == KTRIAC_FREQ_WINDOW)
+    {
+        for ( i = 0; sorted[ i] != core->freqSamples[ core->freqNext]; ++i)
+            ;
+        for ( --n; i < n; ++i)
+            sorted[ i] = sorted[ i + 1];
+    }
+
+    for ( i = n; i > 0 && sorted[ i - 1] > period; --i)
+        sorted[ i] = sorted[ i - 1];
+    sorted[ i] = period;
+
+    core->freqSamples[ core->freqNext] = period;
+    core->freqNext = ( core->freqNext + 1) & ( KTRIAC_FREQ_WINDOW - 1);
+    core->freqCount = ++n;
+
+    //the median until the window is full
+    if ( n < KTRIAC_FREQ_WINDOW)
+    {
+        if ( core->freqNominal)
+            core->freqPeriod = sorted[ n >> 1];
+        return;
+    }
+
+    for ( i = KTRIAC_FREQ_WINDOW / 4; i < KTRIAC_FREQ_WINDOW - KTRIAC_FREQ_WINDOW / 4; ++i)
+        sum += sorted[ i];
+    core->freqPeriod = sum >> ( KTRIAC_FREQ_SHIFT - 1);
+
+    //detected: the closer one of 50 and 60Hz, the PLL acquires it again
+    if ( !core->freqNominal)
+    {
+        core->freqNominal = ( core->freqPeriod < ( half_phase_ns( 50) + half_phase_ns( 60)) / 2) ? half_phase_ns( 60) : half_phase_ns( 50);
+        core->freqDriftLimit = ( core->freqNominal * KTRIAC_FREQ_DRIFT_SCALE) >> 16;
+        core->pllLocked = 0;
+        core->pllGood = 0;
+    }
+
+    if ( core->freqNext)
+        return;
+
+    //the drift over KTRIAC_FREQ_DRIFT_TIME: the jitter of one window would hide it
+    if ( !core->freqDriftFrom || now - core->freqTime > 2LL * KTRIAC_FREQ_DRIFT_TIME * SEC_IN_US * 1000)
+    {
+        core->freqDriftFrom = core->freqPeriod;
+        core->freqTime = now;
+    }
+    else
+    if ( now - core->freqTime >= KTRIAC_FREQ_DRIFT_TIME * SEC_IN_US * 1000LL)
+    {
+        core->freqDriftStart = core->freqDriftFrom;
+        core->freqDriftEnd = core->freqPeriod;
+        core->freqDriftSpan = now - core->freqTime;
+        core->freqDriftFrom = core->freqPeriod;
+        core->freqTime = now;
+    }
+}
+
+/*
+ * Half width of the acceptance window around the predicted zerocross in ns
+ */
+static inline s64 pll_window( struct ktriac_core *core)
+{
+    return core->freqWindow;
+}
+
+/*
+ * Feed an accepted edge to the PLL, returns the estimated zerocross
+ */
+static s64 pll_update( struct ktriac_core *core, s64 now)
+{
+    s64 window = pll_window( core);
+    s64 nominal = core->freqPeriod;
+    s64 err = now - core->pllNext;
+    s64 zc;
+
+    //(re)acquire: start from this edge
+    if ( !core->pllLocked && ( err < -window || err > window))
+    {
+        core->pllPeriod = nominal;
+        core->pllNext = now + core->pllPeriod;
+        core->pllPhaseError = 0;
+        core->pllGood = 0;
+
+        return now;
+    }
+
+    err = clamp( err, -window, window);
+    zc = core->pllNext + err / ( 1 << KTRIAC_PLL_KP_SHIFT);
+    core->pllPeriod = clamp( core->pllPeriod + err / ( 1 << KTRIAC_PLL_KI_SHIFT), nominal - window, nominal + window);
+    core->pllNext = zc + core->pllPeriod;
+    core->pllPhaseError = err;
+    core->pllCoasted = 0;
+
+    if ( err < window / 4 && err > -window / 4)
+    {
+        if ( !core->pllLocked && ++core->pllGood >= KTRIAC_PLL_LOCK_COUNT)
+        {
+            core->pllLocked = 1;
+            core->reports |= REPORT_MAINS_BACK;
+        }
+    }
+    else
+    if ( !core->pllLocked)
+        core->pllGood = 0;
+
+    return zc;
+}
+
+/*
+ * Speed of the tacho pulses until now in rpm: from the pulses since the last
+ * zerocross, or from the time since the last pulse if that is longer.
+ */
+static unsigned int speed_measure( struct ktriac_core *core, s64 now)
+{
+    struct speed_control *sc = &core->speed;
+    unsigned int n = sc->pulses - sc->windowPulses;
+    unsigned int ppr = core->settings->speed.config.pulses_per_rev;
+    s64 period;
+
+    if ( n)
+    {
+        if ( sc->windowStart)
+            sc->period = div_u64( sc->lastPulse - sc->windowStart, n);
+
+        sc->windowStart = sc->lastPulse;
+        sc->windowPulses = sc->pulses;
+    }
+
+    if ( !sc->lastPulse || now - sc->lastPulse > KTRIAC_TACHO_TIMEOUT)
+    {
+        sc->windowStart = 0;
+        sc->period = 0;
+    }
+
+    //slowing down: no pulse for longer than the last period
+    period = ( now - sc->lastPulse > sc->period) ? now - sc->lastPulse : sc->period;
+
+    if ( !sc->period || !ppr)
+        return 0;
+
+    return div64_u64( 60LL * 1000 * 1000 * 1000, (u64)period * ppr);
+}
+
+/*
+ * One step of the PID, once for every accepted zerocross
+ */
+static void speed_update( struct ktriac_core *core, s64 now)
+{
+    const struct speed_setting *speed = &core->settings->speed;
+    struct speed_control *sc = &core->speed;
+    s64 min = (s64)speed->config.out_min << 16;
+    s64 max = (s64)speed->config.out_max << 16;
+    s64 limit = (s64)speed->config.integral_max << 16;
+    s64 p, d, out;
+
+    sc->rpm = speed_measure( core, now);
+
+    if ( speed->reset != sc->reset || speed->config.channel < 0)
+    {
+        sc->reset = speed->reset;
+        sc->integral = 0;
+        sc->lastRpm = sc->rpm;
+    }
+
+    if ( speed->config.channel < 0 || !speed->config.target_rpm)
+    {
+        sc->error = 0;
+        sc->output = 0;
+        return;
+    }
+
+    sc->error = (int)speed->config.target_rpm - (int)sc->rpm;
+    p = speed->kp * sc->error;
+    d = speed->kd * ( (int)sc->lastRpm - (int)sc->rpm);
+    sc->lastRpm = sc->rpm;
+
+    //anti-windup: no integration further into the limit
+    out = p + sc->integral + d;
+    if ( !( out >= max && sc->error > 0) && !( out <= min && sc->error < 0))
+        sc->integral = ( limit) ? clamp( sc->integral + speed->ki * sc->error, -limit, limit)
+                                : clamp( sc->integral + speed->ki * sc->error, min, max);
+
+    out = clamp( p + sc->integral + d, min, max);
+    sc->output = out >> 16;
+}
+
+/*
+ * Three phase mode with phase inputs: a phase is lost without edges, reversed
+ * with edges at the place of the other one. Firing stops at the first fault and
+ * starts again when both phases gave KTRIAC_PHASE_CHECK good edges in a row.
+ */
+static void phase_check( struct ktriac_core *core, s64 now)
+{
+    unsigned int i, blocked = 0;
+
+    if ( !core->phaseInputs)
+        return;
+
+    for ( i = 1; i < KTRIAC_PHASES; ++i)
+    {
+        struct triac_phase *ph = &core->phases[ i];
+        unsigned int fault = 0;
+
+        //no reference without the PLL: the phases are confirmed again when it locks
+        if ( !core->pllLocked)
+        {
+            ph->last = 0;
+            ph->good = ph->reversed = 0;
+        }
+
+        if ( ph->last && now - ph->last > KTRIAC_PHASE_LOST * core->freqPeriod)
+            fault |= PHASE_LOST;
+        if ( ph->reversed >= KTRIAC_PHASE_CHECK)
+            fault |= PHASE_REVERSED;
+
+        if ( fault & ~ph->fault)
+        {
+            ++core->phaseFaults;
+            core->reports |= REPORT_PHASE_FAULT;
+        }
+
+        ph->fault = fault;
+        if ( fault || ph->good < KTRIAC_PHASE_CHECK)
+            blocked = 1;
+    }
+
+    if ( blocked && !core->phaseFault)
+    {
+        //the gates kept on and the pulses still to come
+        for ( i = 0; i < core->channelCount; ++i)
+            if ( is_triac_on( &core->channels[ i]))
+                triac( core, i, OFF);
+
+        core->scheduleLen = core->scheduleNext;
+    }
+    else
+    if ( !blocked && core->phaseFault)
+        core->reports |= REPORT_PHASE_BACK;
+
+    core->phaseFault = blocked;
+}
+
+/*
+ * Load group: decide which members conduct in this half phase. The due ones (a whole
+ * den accumulated) go in the order of acc / den, the most behind first, compared by
+ * multiplying. One goes if the total stays within groupLimit, one KTRIAC_GROUP_DELAY
+ * spacings late goes anyway. The second half of a full cycle burst goes as the first one.
+ */
+static void group_plan( struct ktriac_core *core)
+{
+    unsigned int due[ KTRIAC_MAX_CHANNELS], dueDen[ KTRIAC_MAX_CHANNELS];
+    unsigned int count = 0, total = 0, i, j;
+
+    if ( !core->settings->groupMembers)
+    {
+        core->groupTotal = 0;
+        return;
+    }
+
+    //the members or their duty changed: start from the limit of the settings
+    if ( core->settings->groupChanged != core->groupChanged)
+    {
+        core->groupChanged = core->settings->groupChanged;
+        core->groupLimit = core->settings->groupLimit;
+    }
+
+    for ( i = 0; i < core->channelCount; ++i)
+    {
+        struct triac_channel *ch = &core->channels[ i];
+        const struct triac_setting *set = &core->settings->channel[ i];
+        unsigned int num, den;
+
+        if ( !group_duty( set, &num, &den) || channel_override( core, i))
+            continue;
+
+        if ( set->burst && set->fullCycle && ch->counter)
+        {
+            if ( ch->burstOn)
+                total += set->load;
+            continue;
+        }
+
+        ch->burstOn = 0;
+        ch->burstAcc += num;
+        if ( ch->burstAcc < den)
+            continue;
+
+        for ( j = count; j > 0 && (u64)ch->burstAcc * dueDen[ j - 1] > (u64)core->channels[ due[ j - 1]].burstAcc * den; --j)
+        {
+            due[ j] = due[ j - 1];
+            dueDen[ j] = dueDen[ j - 1];
+        }
+
+        due[ j] = i;
+        dueDen[ j] = den;
+        ++count;
+    }
+
+    for ( j = 0; j < count; ++j)
+    {
+        struct triac_channel *ch = &core->channels[ due[ j]];
+        unsigned int load = core->settings->channel[ due[ j]].load;
+
+        if ( ch->burstAcc < ( KTRIAC_GROUP_DELAY + 1) * dueDen[ j] && total + load > core->groupLimit)
+            continue;
+
+        ch->burstOn = 1;
+        ch->burstAcc -= dueDen[ j];
+        total += load;
+    }
+
+    //the late ones went over the limit: the group cannot do with less
+    if ( total > core->groupLimit)
+        core->groupLimit = total;
+
+    core->groupTotal = total;
+    if ( total > core->groupPeak)
+        core->groupPeak = total;
+    core->groupEnergy += total;
+    ++core->groupHalfPhases;
+}
+
+/*
+ * The status of the control page after planning the half phase of zc, a seqlock:
+ * odd sequence while it is written
+ */
+static void control_update( struct ktriac_core *core, s64 zc)
+{
+    struct ktriac_control_status *status = core->controlStatus;
+    unsigned int i;
+
+    if ( !status)
+        return;
+
+    WRITE_ONCE( status->sequence, status->sequence + 1);
+    smp_wmb();
+
+    status->locked = core->pllLocked;
+    status->last_zerocross = zc;
+    status->next_zerocross = ( core->pllLocked) ? core->pllNext : zc + core->freqPeriod;
+    status->half_period_ns = core->freqPeriod;
+
+    for ( i = 0; i < core->channelCount; ++i)
+    {
+        const struct triac_channel *ch = &core->channels[ i];
+        const struct triac_setting *set = &core->settings->channel[ i];
+
+        status->channel[ i].taken = ch->setpointSeq;
+        status->channel[ i].duty = ( ch->setpointType != KTRIAC_SETPOINT_NONE) ? ch->setpointDuty : set->duty;
+        status->channel[ i].offset_ns = core->phases[ set->phase].offset;
+    }
+
+    smp_wmb();
+    WRITE_ONCE( status->sequence, status->sequence + 1);
+}
+
+/*
+ * Plan the half phase starting at the zerocross zc,
+ * from the edge or from the timer when the PLL coasts.
+ */
+static void zerocross_plan( struct ktriac_core *core, s64 zc, s64 now, s64 delta, unsigned int reason)
+{
+        unsigned int i;
+
+        settings_take( core);
+
+        if ( core->settings->freqChanged != core->freqChanged)
+            freq_reset( core);
+        freq_derive( core);
+
+        //report the last half phase
+        for ( i = 0; i < core->channelCount; ++i)
+        {
+            struct triac_channel *ch = &core->channels[ i];
+            const struct triac_setting *set = &core->settings->channel[ i];
+
+            if ( ch->fired)
+            {
+                core_emit( core, KTRIAC_EVENT_GATE, KTRIAC_REASON_NONE, i, core->lastZerocross, ch->fired, ch->released, 0);
+                ch->fired = ch->released = 0;
+            }
+
+            //new settings start with a new pwm period and stop or start the ramp
+            if ( set->changed != ch->changed)
+            {
+                unsigned int num, den;
+
+                ch->changed = set->changed;
+                ch->counter = 0;
+                ch->burstAcc = ( group_duty( set, &num, &den)) ? den / 2 : set->burstDen / 2;
+                ch->burstOn = 0;
+
+                if ( set->rampStart != ch->rampStart && set->rampCount)
+                {
+                    ch->rampActive = 1;
+                    ch->rampSegment = 0;
+                    ch->rampStep = core->settings->ramps[ i][ 0].startStep;
+                    ch->rampTime = 0;
+                }
+                else
+                if ( !set->rampCount)
+                    ch->rampActive = 0;
+
+                ch->rampStart = set->rampStart;
+
+                trace_ktriac_config( i, set->angle, set->power, set->mark, set->space, set->duty);
+                core_emit( core, KTRIAC_EVENT_CONFIG, KTRIAC_REASON_NONE, i, now, 0, 0, set->duty);
+            }
+        }
+
+        trace_ktriac_zerocross( now, zc, delta, reason);
+        core_emit( core, KTRIAC_EVENT_ZEROCROSS, reason, 0, now, zc, 0, delta);
+
+        if ( reason != KTRIAC_REASON_COAST)
+            speed_update( core, now);
+
+        calib_update( core);
+        phase_check( core, now);
+
+        core->lastZerocross = zc;
+        core->lastPlan = now;
+
+        schedule_compact( core);
+
+        if ( core->freqNominal && !core->phaseFault)
+            group_plan( core);
+
+        //no firing until the frequency is known and while a phase is missing,
+        //the channels of L2 and L3 start their half phase at their own zerocross
+        for ( i = 0; i < core->channelCount && core->freqNominal && !core->phaseFault; ++i)
+            channel_zerocross( core, i, zc + core->phases[ core->settings->channel[ i].phase].offset, reason == KTRIAC_REASON_COAST);
+
+        control_update( core, zc);
+
+        //go on with the prediction if the next zerocross does not come,
+        //in dual edge mode it is known only at the end of the pulse
+        if ( core->pllLocked && core->scheduleLen < SCHEDULE_SIZE)
+            schedule_add( core, core->pllNext + pll_window( core) + ( core->widthAvg >> 1), 0, COAST);
+}
+
+/*
+ * The predicted zerocross did not come, called from the timer
+ */
+static void pll_coast( struct ktriac_core *core, s64 now)
+{
+    s64 zc = core->pllNext;
+
+    if ( !core->pllLocked)
+        return;
+
+    ++core->pllCoastedTotal;
+
+    //mains lost: stop firing until the PLL locks again
+    if ( ++core->pllCoasted > KTRIAC_PLL_COAST)
+    {
+        core->pllLocked = 0;
+        core->pllGood = 0;
+        ++core->mainsLost;
+        core->reports |= REPORT_MAINS_LOST;
+        control_update( core, core->lastZerocross);
+        return;
+    }
+
+    core->pllNext = zc + core->pllPeriod;
+    zerocross_plan( core, zc, now, 0, KTRIAC_REASON_COAST);
+}
+
+/*
+ * Zerocross edge at now: gate it, feed the PLL and plan the half phase,
+ * then arm the timer if anything is to be switched.
+ * Returns the KTRIAC_REASON_* of the edge, a rejected one only gets reported.
+ */
+unsigned int ktriac_core_edge( struct ktriac_core *core, s64 now)
+{
+        unsigned int reason = KTRIAC_REASON_NONE;
+        s64 period = now - core->lastRising;
+        s64 zc;
+        s64 delta;
+
+        delta = ns_to_us( period);
+
+
+        //don't handle events < 300us
+        if ( period < 300 * 1000)
+            reason = KTRIAC_REASON_GLITCH;
+        else
+        //locked PLL: accept only around the predicted zerocross
+        if ( core->pllLocked)
+        {
+            if ( now < core->pllNext - pll_window( core))
+                reason = KTRIAC_REASON_EARLY;
+        }
+        else
+        if ( period < core->freqLower)
+            reason = KTRIAC_REASON_EARLY;
+
+        if ( reason != KTRIAC_REASON_NONE)
+        {
+            ++core->reasons[ reason];
+            hist_add( &core->histReject, now - core->lastRising);
+            trace_ktriac_reject( now, delta, reason);
+            core_emit( core, KTRIAC_EVENT_REJECT, reason, 0, now, 0, 0, delta);
+            return reason;
+        }
+
+        if ( period > core->freqUpper)
+        {
+            reason = KTRIAC_REASON_LATE;
+            ++core->reasons[ reason];
+
+            if ( period > SEC_IN_US * 1000LL)
+            {
+                ++core->outOfFreq;
+                core->reportDelta = delta;
+                core->reports |= REPORT_OUT_OF_FREQ;
+            }
+        }
+
+        hist_add( &core->histPeriod, period);
+
+        //a late one too if it can be a drifted half period
+        if ( reason == KTRIAC_REASON_NONE || core->freqNominal)
+            freq_measure( core, period, now);
+
+        zc = pll_update( core, now);
+        core->lastRising = now;
+
+        zerocross_plan( core, zc, now, delta, reason);
+
+        //the timer callback does not touch a timer we have started already
+        if ( core->scheduleNext < core->scheduleLen)
+        {
+            trace_ktriac_arm( now, core->schedule[ core->scheduleNext].time);
+            core->hw->arm( core->ctx, core->schedule[ core->scheduleNext].time);
+        }
+
+        return reason;
+}
+
+/*
+ * Dual edge mode: an edge of the zerocross pulse at now, level is the input after it.
+ * The input is low during the zerocross: the falling edge starts the pulse, the
+ * rising one ends it and the middle of the pulse goes to ktriac_core_edge.
+ * Returns the KTRIAC_REASON_* of the pulse, NONE at its start.
+ */
+unsigned int ktriac_core_pulse( struct ktriac_core *core, s64 now, unsigned int level)
+{
+        s64 width, limit;
+
+        if ( !level)
+        {
+            core->lastFalling = now;
+            return KTRIAC_REASON_NONE;
+        }
+
+        //the start of the pulse was lost
+        if ( !core->lastFalling)
+            return KTRIAC_REASON_WIDTH;
+
+        width = now - core->lastFalling;
+        core->lastFalling = 0;
+
+        hist_add( &core->histWidth, width);
+
+        if ( core->widthCount >= KTRIAC_WIDTH_LEARN)
+        {
+            limit = ( core->widthAvg * KTRIAC_WIDTH_SCALE) >> 16;
+
+            if ( width < core->widthAvg - limit || width > core->widthAvg + limit)
+            {
+                ++core->widthRejected;
+                ++core->reasons[ KTRIAC_REASON_WIDTH];
+
+                //not the pulses the average was learned on
+                if ( ++core->widthStreak >= KTRIAC_WIDTH_LEARN)
+                    core->widthCount = 0;
+
+                trace_ktriac_reject( now, ns_to_us( width), KTRIAC_REASON_WIDTH);
+                core_emit( core, KTRIAC_EVENT_REJECT, KTRIAC_REASON_WIDTH, 0, now, 0, 0, ns_to_us( width));
+                return KTRIAC_REASON_WIDTH;
+            }
+        }
+
+        core->widthStreak = 0;
+
+        if ( core->widthCount == 0)
+        {
+            core->widthAvg = core->widthMin = core->widthMax = width;
+            core->widthDev = 0;
+        }
+        else
+        {
+            s64 diff = width - core->widthAvg;
+
+            core->widthAvg += diff >> KTRIAC_WIDTH_SHIFT;
+            core->widthDev += ( ( ( diff < 0) ? -diff : diff) - core->widthDev) >> KTRIAC_WIDTH_SHIFT;
+
+            if ( width < core->widthMin)
+                core->widthMin = width;
+            if ( width > core->widthMax)
+                core->widthMax = width;
+        }
+
+        if ( core->widthCount < KTRIAC_WIDTH_LEARN)
+            ++core->widthCount;
+
+        return ktriac_core_edge( core, now - ( width >> 1));
+}
+
+/*
+ * Timer expired: switches every gate due until now + mergeWindow.
+ * Returns the time of the next event of the schedule, 0 if there is none.
+ */
+s64 ktriac_core_timer( struct ktriac_core *core, s64 now, s64 mergeWindow)
+{
+    s64 horizon = now + mergeWindow;
+    unsigned int coast = 0;
+
+    while ( core->scheduleNext < core->scheduleLen && core->schedule[ core->scheduleNext].time <= horizon)
+    {
+        struct triac_event *event = &core->schedule[ core->scheduleNext++];
+        struct triac_channel *ch = &core->channels[ event->channel];
+
+        if ( event->action == COAST)
+        {
+            coast = 1;
+            continue;
+        }
+
+        triac( core, event->channel, event->action);
+        trace_ktriac_gate( event->channel, event->action, event->time, now);
+
+        if ( event->action == ON)
+        {
+            channel_energy( core, event->channel, now);
+            ch->fired = now;
+            hist_add( &ch->histLate, now - event->time);
+            hist_add( &ch->histFire, now - core->lastPlan);
+        }
+        else
+            ch->released = now;
+    }
+
+    //no zerocross came in the tolerance range: go on from the predicted one
+    if ( coast)
+        pll_coast( core, now);
+
+    if ( core->scheduleNext < core->scheduleLen)
+    {
+        trace_ktriac_arm( now, core->schedule[ core->scheduleNext].time);
+        return core->schedule[ core->scheduleNext].time;
+    }
+
+    return 0;
+}
+
+/*
+ * Average power of the delivered energy in the time counted, in ppm of the full power
+ */
+unsigned int energy_ppm( u64 energy, u64 time)
+{
+    //( energy >> shift) * 1000000 fits in 64 bits
+    unsigned int shift = ( fls64( time) > 44) ? fls64( time) - 44 : 0;
+
+    if ( !( time >> shift))
+        return 0;
+
+    return div64_u64( ( energy >> shift) * 1000000, time >> shift);
+}
+
+/*
+ * The measured frequency in mHz, 0 until the first full window
+ */
+s64 freq_milli( const struct ktriac_core *core)
+{
+    s64 period = READ_ONCE( core->freqPeriod);
+
+    if ( READ_ONCE( core->freqCount) < KTRIAC_FREQ_WINDOW || period <= 0)
+        return 0;
+
+    return div64_u64( 500000000000ULL, period);
+}
+
+/*
+ * The drift of the frequency in mHz/s over the last KTRIAC_FREQ_DRIFT_TIME s,
+ * the values the edge left may be of two measurements: only for reporting
+ */
+s64 freq_drift( const struct ktriac_core *core)
+{
+    s64 start = READ_ONCE( core->freqDriftStart);
+    s64 end = READ_ONCE( core->freqDriftEnd);
+    s64 span = div_s64( READ_ONCE( core->freqDriftSpan), SEC_IN_US);
+
+    if ( start <= 0 || end <= 0 || span <= 0)
+        return 0;
+
+    return div_s64( ( div64_u64( 500000000000ULL, end) - div64_u64( 500000000000ULL, start)) * 1000, span);
+}
+
+/*
+ * The load group of the settings: the rated and the average power of the members,
+ * the limit starts from the larger of the average and the largest load
+ */
+static void group_derive( const struct ktriac_core *core, struct ktriac_settings *cfg)
+{
+    unsigned int i, num, den, members = 0, rated = 0, largest = 0;
+    u64 demand = 0;
+
+    for ( i = 0; i < core->channelCount; ++i)
+    {
+        const struct triac_setting *set = &cfg->channel[ i];
+
+        if ( !group_duty( set, &num, &den))
+            continue;
+
+        ++members;
+        rated += set->load;
+        demand += div_u64( ( (u64)set->load << 16) * num, den);
+        if ( set->load > largest)
+            largest = set->load;
+    }
+
+    demand = ( demand + 0xFFFF) >> 16;
+
+    if ( members != cfg->groupMembers || rated != cfg->groupRated || demand != cfg->groupDemand)
+        ++cfg->groupChanged;
+
+    cfg->groupMembers = members;
+    cfg->groupRated = rated;
+    cfg->groupDemand = demand;
+    cfg->groupLimit = ( demand > largest) ? demand : largest;
+}
+
+/*
+ * The control page of userspace: the edge updates the status and samples the setpoints
+ * from the next zerocross. Call it before the irqs start.
+ */
+void ktriac_core_control( struct ktriac_core *core, struct ktriac_control_status *status, const struct ktriac_setpoint *setpoints)
+{
+    core->controlStatus = status;
+    core->setpoints = setpoints;
+
+    if ( status)
+        status->channels = core->channelCount;
+}
+
+/*
+ * Publish a copy of the staged settings, the edge takes it over at the next
+ * zerocross. A copy not taken over yet is replaced. Call it from the writer.
+ */
+void ktriac_core_publish( struct ktriac_core *core)
+{
+    group_derive( core, &core->staged);
+    memcpy( &core->settingsBuf[ core->settingsBack], &core->staged, sizeof( core->staged));
+    core->settingsBack = xchg( &core->settingsMiddle, core->settingsBack | SETTINGS_FRESH) & ~SETTINGS_FRESH;
+}
+
+/*
+ * Tachometer pulse at now
+ */
+void ktriac_core_tacho( struct ktriac_core *core, s64 now)
+{
+    struct speed_control *sc = &core->speed;
+
+    if ( sc->lastPulse && now - sc->lastPulse < KTRIAC_TACHO_GLITCH)
+    {
+        ++sc->glitches;
+        return;
+    }
+
+    sc->lastPulse = now;
+    ++sc->pulses;
+}
+
+/*
+ * Edge of the load current sense input at now, level: the input after it
+ */
+void ktriac_core_sense( struct ktriac_core *core, s64 now, unsigned int level)
+{
+    struct calibration *cal = &core->calib;
+
+    ++cal->senseEdges;
+
+    if ( !cal->planned)
+        return;
+
+    if ( level)
+        cal->conducted = 1;
+    else
+    if ( cal->conducted && !cal->ended)
+    {
+        cal->ended = 1;
+        cal->endAt = now;
+    }
+}
+
+/*
+ * The platform has zerocross inputs for L2 and L3: their offsets are measured
+ * and checked, nothing fires until both are confirmed. Call it after the init.
+ */
+void ktriac_core_phase_inputs( struct ktriac_core *core)
+{
+    core->phaseInputs = 1;
+    core->phaseFault = 1;
+}
+
+/*
+ * Rising edge of the zerocross input of phase index (1: L2, 2: L3) at now.
+ * It is placed in the half phase of L1: at the expected place it is a good one,
+ * at the place of the other phase a reversed one, anything else is noise.
+ */
+void ktriac_core_phase( struct ktriac_core *core, unsigned int index, s64 now)
+{
+    struct triac_phase *ph, *other;
+    s64 period = core->freqPeriod;
+    s64 offset, sector, diff;
+
+    if ( index == 0 || index >= KTRIAC_PHASES)
+        return;
+
+    ph = &core->phases[ index];
+    other = &core->phases[ KTRIAC_PHASES - index];
+    ++ph->edges;
+
+    if ( !core->pllLocked || period <= 0)
+    {
+        ++ph->rejected;
+        return;
+    }
+
+    //dual edge mode: the rising edge ends a pulse like the one of L1, its middle is the zerocross
+    if ( core->widthCount)
+        now -= core->widthAvg >> 1;
+
+    offset = now - core->lastZerocross;
+    while ( offset < 0)
+        offset += period;
+    while ( offset >= period)
+        offset -= period;
+
+    //the expected places are a third of the half phase apart, sector is the half of it
+    sector = ( (u64)period * 0x2AAAAAABULL) >> 32;
+    diff = offset - ph->expected;
+
+    if ( diff > -sector && diff < sector)
+    {
+        diff = offset - ph->offset;
+
+        //confirmed: an edge further than the tolerance from the measured place is noise
+        if ( ph->good >= KTRIAC_PHASE_CHECK && ( diff < -core->freqWindow || diff > core->freqWindow))
+        {
+            ++ph->rejected;
+            return;
+        }
+
+        if ( ph->good)
+            ph->offset += diff >> KTRIAC_PHASE_SHIFT;
+        else
+            ph->offset = offset;
+
+        if ( ph->good < KTRIAC_PHASE_CHECK)
+            ++ph->good;
+        ph->reversed = 0;
+        ph->last = now;
+        return;
+    }
+
+    diff = offset - other->expected;
+
+    if ( diff > -sector && diff < sector)
+    {
+        if ( ph->reversed < KTRIAC_PHASE_CHECK)
+            ++ph->reversed;
+        ph->good = 0;
+        ph->last = now;
+        return;
+    }
+
+    ++ph->rejected;
+}
+
+/*
+ * Defaults of every setting, all outputs off
+ */
+void ktriac_core_init( struct ktriac_core *core, const struct ktriac_hw *hw, void *ctx, unsigned int channelCount)
+{
+    unsigned int i;
+
+    memset( core, 0, sizeof( *core));
+    core->hw = hw;
+    core->ctx = ctx;
+    core->channelCount = channelCount;
+
+    memcpy( core->powerCurve, default_power_curve, sizeof( core->powerCurve));
+    core->staged.powerCurve = core->powerCurve;
+
+    //init ac freq variables
+    core->staged.tolerance = AC_DEFAULT_TOLERANCE;
+    set_ac_frequent( &core->staged, AC_DEFAULT_FREQ);
+    set_zerocross_latency( &core->staged, ZEROCROSS_DEFAULT_LATENCY);
+
+    for ( i = 0; i < channelCount; ++i)
+    {
+        struct triac_setting *set = &core->staged.channel[ i];
+
+        core->channels[ i].status = OFF;
+
+        set->angle = -1;
+        set->power = -1;
+        set->fireTime = TRIAC_DEFAULT_FIRE_TIME;
+    }
+
+    core->staged.speed.config.channel = -1;
+    core->staged.speed.config.out_max = KTRIAC_POWER_STEPS;
+    core->staged.speed.config.pulses_per_rev = 1;
+    core->staged.calibChannel = -1;
+
+    core->settingsBuf[ 0] = core->staged;
+    core->settings = &core->settingsBuf[ 0];
+    core->settingsFront = 0;
+    core->settingsMiddle = 1;
+    core->settingsBack = 2;
+    core->pllPeriod = core->settings->halfPhase * 1000;
+
+    freq_reset( core);
+    freq_derive( core);
+}
+
+void set_triac_attack_angle( struct ktriac_settings *cfg, unsigned int index, int angle_deg)
+{
+    struct triac_setting *set = &cfg->channel[ index];
+
+    set->mark = set->space = 0;
+    set->burst = 0;
+    set->rampCount = 0;
+    set->power = -1;
+
+    if ( angle_deg > 180 || angle_deg < 0 || cfg->ac_freq == 0)
+    {
+        set->angle = -1;
+        set->duty = 0;
+
+        goto update;
+        return;
+    }
+    else
+    {
+        set->triggerDelay = angle_to_delay( cfg, angle_deg);
+    }
+
+    set->duty = angle_to_percent_table[ angle_deg];
+    set->angle = angle_deg;
+
+update:
+        //reported by the next zerocross
+        ++set->changed;
+        return;
+}
+
+/*
+ * Power in 1/KTRIAC_POWER_STEPS: the gate delay comes from the power table
+ */
+void set_triac_power( struct ktriac_settings *cfg, unsigned int index, int power)
+{
+    struct triac_setting *set = &cfg->channel[ index];
+
+    set->mark = set->space = 0;
+    set->burst = 0;
+    set->rampCount = 0;
+
+    if ( power > KTRIAC_POWER_STEPS)
+        power = KTRIAC_POWER_STEPS;
+
+    if ( power <= 0 || cfg->ac_freq == 0)
+    {
+        set->power = 0;
+        set->angle = -1;
+        set->duty = 0;
+    }
+    else
+    {
+        set->power = power;
+        set->triggerDelay = cfg->powerDelay[ power];
+        //the angle is only shown, the delay is exact
+        set->angle = ( cfg->powerCurve[ power] * 180 + 32768) >> 16;
+        if ( set->angle == 0 && set->triggerDelay)
+            set->angle = 1;
+        set->duty = ( power + 5) / ( KTRIAC_POWER_STEPS / 100);
+    }
+
+    //reported by the next zerocross
+    ++set->changed;
+}
+
+void set_triac_pwm( struct ktriac_settings *cfg, unsigned int index, int m, int s)
+{
+    struct triac_setting *set = &cfg->channel[ index];
+
+    set->angle = -1;
+    set->power = -1;
+    set->burst = 0;
+    set->rampCount = 0;
+
+    //a wrong period turns the channel off
+    if ( m <= 0 || s < 0 || m > KTRIAC_BURST_MAX || s > KTRIAC_BURST_MAX || m + s > KTRIAC_BURST_MAX)
+        m = s = 0;
+
+    set->mark = m;
+    set->space = s;
+
+    set->duty = ( set->mark) ? set->mark * 100 / ( set->mark + set->space) : 0;
+
+    ++set->changed;
+}
+
+/*
+ * Burst of whole half phases: num of every den conduct, num <= den checked
+ */
+void set_triac_burst( struct ktriac_settings *cfg, unsigned int index, unsigned int num, unsigned int den, unsigned int flags)
+{
+    struct triac_setting *set = &cfg->channel[ index];
+
+    set->angle = -1;
+    set->power = -1;
+    set->mark = set->space = 0;
+    set->rampCount = 0;
+
+    set->burst = 1;
+    set->burstNum = num;
+    set->burstDen = den;
+    set->fullCycle = ( flags & KTRIAC_BURST_FULL_CYCLE) ? 1 : 0;
+
+    set->duty = div_u64( (u64)num * 100, den);
+
+    ++set->changed;
+}
+
+void set_ac_frequent( struct ktriac_settings *cfg, int freq)
+{
+    unsigned int duration, hz;
+    unsigned int detect = ( freq == 0);
+
+    //out of range the half phase truncates and the inverse divides by 0
+    if ( !detect && ( freq < KTRIAC_FREQ_MIN || freq > KTRIAC_FREQ_MAX))
+        return;
+
+    //detecting: the tables stay, the edge scales them to the mains
+    if ( detect)
+        hz = ( cfg->ac_freq) ? cfg->ac_freq : 50;
+    else
+        hz = freq;
+
+    if ( detect != cfg->freqAuto || hz != cfg->ac_freq)
+        ++cfg->freqChanged;
+
+    cfg->freqAuto = detect;
+    cfg->ac_freq = hz;
+
+    //half period duration
+    duration = SEC_IN_US / 2 / cfg->ac_freq;
+
+    cfg->freqTimeLowerBound = ( duration * ( 100 - cfg->tolerance)) / 100;
+    cfg->freqTimeUpperBound = ( duration * ( 100 + cfg->tolerance)) / 100;
+
+    cfg->halfPhase = duration;
+    cfg->toleranceScale = ( cfg->tolerance << 16) / 100;
+    cfg->halfPhaseInverse = div_u64( 1ULL << 48, half_phase_ns( cfg->ac_freq));
+    cfg->angleScale = div_u64( (u64)half_phase_ns( cfg->ac_freq) << 16, 180);
+    power_table_build( cfg);
+    ktriac_info( "ktriac: setting ac_freq: %d Hz freqTimeLowerBound: %d us freqTimeUpperBound: %d s\n", cfg->ac_freq, cfg->freqTimeLowerBound, cfg->freqTimeUpperBound);
+}
+
+void set_zerocross_latency( struct ktriac_settings *cfg, int value)
+{
+    //a latency out of the half phase moves every gate event into another one
+    if ( value <= -KTRIAC_LATENCY_MAX || value >= KTRIAC_LATENCY_MAX)
+        return;
+
+    cfg->latencyFromEnd = ( value < 0);
+
+    if ( value < 0)
+        cfg->zeroCrossLatency = cfg->halfPhase + value;
+    else
+        cfg->zeroCrossLatency = value;
+}
+
+void set_triac_phase( struct ktriac_settings *cfg, unsigned int index, unsigned int phase)
+{
+    struct triac_setting *set = &cfg->channel[ index];
+
+    if ( phase >= KTRIAC_PHASES || phase == set->phase)
+        return;
+
+    set->phase = phase;
+    ++set->changed;
+}
+
+/*
+ * Rated power of the load in W, 0 takes the channel out of the load group
+ */
+void set_triac_load( struct ktriac_settings *cfg, unsigned int index, unsigned int load)
+{
+    struct triac_setting *set = &cfg->channel[ index];
+
+    if ( load > KTRIAC_LOAD_MAX || load == set->load)
+        return;
+
+    set->load = load;
+    ++set->changed;
+}
+
+void set_tolerance( struct ktriac_settings *cfg, int value)
+{
+    cfg->tolerance = value;
+    set_ac_frequent( cfg, ( cfg->freqAuto) ? 0 : cfg->ac_freq);
+}
+
+/*
+ * A power curve must not fire later with more power
+ */
+int power_curve_check( const u16 *curve)
+{
+    unsigned int i;
+
+    for ( i = 2; i <= KTRIAC_POWER_STEPS; ++i)
+        if ( curve[ i] > curve[ i - 1])
+            return -EINVAL;
+
+    return 0;
+}
+
+/*
+ * Replace the checked power curve, called with the staged lock held.
+ * The staged settings get the new delays, in effect from the next zerocross.
+ */
+void set_power_curve( struct ktriac_core *core, const u16 *curve)
+{
+    memcpy( core->powerCurve, curve, sizeof( core->powerCurve));
+    power_table_build( &core->staged);
+}
+
+/*
+ * Check the segments of a ramp like the ramp utility does
+ */
+int ramp_check( const struct ktriac_ramp_segment *segments, unsigned int count)
+{
+    unsigned int i;
+
+    if ( count == 0 || count > KTRIAC_MAX_RAMP)
+        return -EINVAL;
+
+    for ( i = 0; i < count; ++i)
+    {
+        const struct ktriac_ramp_segment *def = &segments[ i];
+
+        if ( def->from > 100 || def->to > 100 || def->time_ms > 1000000)
+            return -EINVAL;
+
+        if ( def->step == 0 && def->from != def->to)
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Stage a checked ramp of the channel, it starts at the next zerocross.
+ * actual >= 0 skips the steps of the first segment below/above it (ramp -n),
+ * KTRIAC_RAMP_CURRENT starts from the actual power of the channel.
+ * The settings get the end of the ramp: they are in effect when it is over.
+ */
+void set_triac_ramp( struct ktriac_core *core, struct ktriac_settings *cfg, unsigned int index,
+                     const struct ktriac_ramp_segment *segments, unsigned int count, int actual)
+{
+    struct triac_channel *ch = &core->channels[ index];
+    struct ramp_segment *seg;
+    unsigned int i, j;
+
+    if ( actual == KTRIAC_RAMP_CURRENT)
+        actual = ( ch->rampActive) ? ch->rampPercent : (int)cfg->channel[ index].duty;
+
+    set_triac_power( cfg, index, segments[ count - 1].to * ( KTRIAC_POWER_STEPS / 100));
+
+    for ( i = 0; i < count; ++i)
+    {
+        const struct ktriac_ramp_segment *def = &segments[ i];
+        int range = def->to - def->from;
+
+        seg = &cfg->ramps[ index][ i];
+        seg->from = def->from;
+        seg->to = def->to;
+        seg->steps = ( range) ? abs( range) / def->step : 1;
+        if ( seg->steps == 0)
+            seg->steps = 1;
+
+        seg->inc = range * 256 / (int)seg->steps;
+        seg->stepTime = div_u64( (u64)def->time_ms * 1000000, seg->steps);
+
+        seg->startStep = 0;
+    }
+
+    //start at the first step reaching the actual power, or with the last one
+    seg = &cfg->ramps[ index][ 0];
+    if ( actual >= 0 && seg->inc)
+    {
+        for ( j = 0; j < seg->steps; ++j)
+        {
+            int value = ( seg->from * 256 + seg->inc * (int)( j + 1)) / 256;
+
+            if ( ( seg->inc > 0 && value >= actual) || ( seg->inc < 0 && value <= actual))
+                break;
+        }
+
+        seg->startStep = ( j < seg->steps) ? j : seg->steps - 1;
+    }
+
+    cfg->channel[ index].rampCount = count;
+    ++cfg->channel[ index].rampStart;
+}
+
+/*
+ * The buffer the writer can fill, NULL if both are queued or playing
+ */
+struct wave_buffer *wave_buffer( struct ktriac_core *core, unsigned int index)
+{
+    struct wave_player *wave = &core->wave[ index];
+    struct wave_buffer *buf = &wave->buffer[ wave->fill];
+
+    return ( smp_load_acquire( &buf->state) == WAVE_FREE) ? buf : NULL;
+}
+
+int wave_check( const struct ktriac_wave_entry *entries, unsigned int count)
+{
+    unsigned int i;
+
+    if ( count == 0 || count > KTRIAC_WAVE_SIZE)
+        return -EINVAL;
+
+    for ( i = 0; i < count; ++i)
+    {
+        if ( entries[ i].type == KTRIAC_WAVE_ANGLE && entries[ i].value > 180)
+            return -EINVAL;
+
+        if ( entries[ i].type == KTRIAC_WAVE_POWER && entries[ i].value > KTRIAC_POWER_STEPS)
+            return -EINVAL;
+
+        if ( entries[ i].type > KTRIAC_WAVE_POWER)
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Hand the filled buffer over to the edge, it starts at the next zerocross
+ * if nothing plays, after the playing buffer otherwise.
+ */
+void wave_queue( struct ktriac_core *core, unsigned int index, unsigned int count, unsigned int flags)
+{
+    struct wave_player *wave = &core->wave[ index];
+    struct wave_buffer *buf = &wave->buffer[ wave->fill];
+
+    buf->count = count;
+    buf->flags = flags;
+    smp_store_release( &buf->state, WAVE_READY);
+
+    wave->fill ^= 1;
+}
+
+/*
+ * Drop both buffers, the settings of the channel take over at the next zerocross
+ */
+void wave_stop( struct ktriac_core *core, unsigned int index)
+{
+    struct wave_player *wave = &core->wave[ index];
+
+    wave->buffer[ 0].state = WAVE_FREE;
+    wave->buffer[ 1].state = WAVE_FREE;
+    wave->active = 0;
+    wave->playing = 0;
+    wave->fill = 0;
+    ++core->waveFreed;
+}
+
+int speed_check( struct ktriac_core *core, const struct ktriac_speed *speed)
+{
+    if ( speed->channel >= (int)core->channelCount || speed->channel < -1)
+        return -EINVAL;
+
+    if ( speed->out_min > speed->out_max || speed->out_max > KTRIAC_POWER_STEPS || !speed->pulses_per_rev)
+        return -EINVAL;
+
+    if ( speed->integral_max > KTRIAC_POWER_STEPS)
+        return -EINVAL;
+
+    if ( speed->target_rpm > 1000000)
+        return -EINVAL;
+
+    return 0;
+}
+
+/*
+ * New speed control settings: the gains to 1/65536, the controller restarts
+ */
+void set_speed( struct ktriac_settings *cfg, const struct ktriac_speed *speed)
+{
+    cfg->speed.config = *speed;
+    cfg->speed.kp = div_s64( (s64)speed->kp << 16, 1000);
+    cfg->speed.ki = div_s64( (s64)speed->ki << 16, 1000);
+    cfg->speed.kd = div_s64( (s64)speed->kd << 16, 1000);
+    ++cfg->speed.reset;
+}
+
+//channel < 0 stops it
+void set_calibration( struct ktriac_settings *cfg, int channel)
+{
+    cfg->calibChannel = channel;
+    ++cfg->calibStart;
+}
+
+/*
+ * Validate one command, nothing is changed yet
+ */
+int config_check( struct ktriac_core *core, const struct ktriac_config *config)
+{
+    unsigned int modes = config->set & ( KTRIAC_SET_ANGLE | KTRIAC_SET_PERCENT | KTRIAC_SET_POWER | KTRIAC_SET_PWM | KTRIAC_SET_BURST);
+
+    if ( config->set & ~KTRIAC_SET_ALL)
+        return -EINVAL;
+
+    //only one power mode at once
+    if ( modes & ( modes - 1))
+        return -EINVAL;
+
+    if ( config->channel >= core->channelCount)
+        return -EINVAL;
+
+    if ( ( config->set & KTRIAC_SET_PERCENT) && ( config->value < 0 || config->value > 100))
+        return -EINVAL;
+
+    if ( ( config->set & KTRIAC_SET_POWER) && ( config->value < 0 || config->value > KTRIAC_POWER_STEPS))
+        return -EINVAL;
+
+    //each one capped first: the sum must not wrap
+    if ( ( config->set & KTRIAC_SET_PWM) &&
+         ( config->mark > KTRIAC_BURST_MAX || config->space > KTRIAC_BURST_MAX ||
+           config->mark + config->space == 0 || config->mark + config->space > KTRIAC_BURST_MAX))
+        return -EINVAL;
+
+    if ( ( config->set & KTRIAC_SET_FIRE_TIME) && config->fire_time_us > KTRIAC_FIRE_TIME_MAX)
+        return -EINVAL;
+
+    if ( ( config->set & KTRIAC_SET_LATENCY) &&
+         ( config->latency_us <= -KTRIAC_LATENCY_MAX || config->latency_us >= KTRIAC_LATENCY_MAX))
+        return -EINVAL;
+
+    if ( ( config->set & KTRIAC_SET_FREQUENCY) && config->frequency &&
+         ( config->frequency < KTRIAC_FREQ_MIN || config->frequency > KTRIAC_FREQ_MAX))
+        return -EINVAL;
+
+    if ( ( config->set & KTRIAC_SET_BURST) &&
+         ( config->mark > KTRIAC_BURST_MAX || config->space > KTRIAC_BURST_MAX ||
+           config->mark + config->space == 0 || config->mark + config->space > KTRIAC_BURST_MAX ||
+           ( config->value & ~KTRIAC_BURST_FULL_CYCLE)))
+        return -EINVAL;
+
+    if ( ( config->set & KTRIAC_SET_TOLERANCE) && config->tolerance > 100)
+        return -EINVAL;
+
+    if ( ( config->set & KTRIAC_SET_PHASE) && config->phase >= KTRIAC_PHASES)
+        return -EINVAL;
+
+    return 0;
+}
+
+/*
+ * Apply one checked command to the staged settings, called with the staged lock held.
+ * The mains settings go first: the angle depends on the frequency.
+ */
+void config_apply( struct ktriac_settings *cfg, const struct ktriac_config *config)
+{
+    if ( config->set & KTRIAC_SET_TOLERANCE)
+        cfg->tolerance = config->tolerance;
+
+    if ( config->set & ( KTRIAC_SET_FREQUENCY | KTRIAC_SET_TOLERANCE))
+        set_ac_frequent( cfg, ( config->set & KTRIAC_SET_FREQUENCY) ? config->frequency : ( cfg->freqAuto) ? 0 : cfg->ac_freq);
+
+    if ( config->set & KTRIAC_SET_LATENCY)
+        set_zerocross_latency( cfg, config->latency_us);
+
+    if ( config->set & KTRIAC_SET_FIRE_TIME)
+    {
+        cfg->channel[ config->channel].fireTime = (s64)config->fire_time_us * 1000;
+        ++cfg->channel[ config->channel].changed;
+    }
+
+    if ( config->set & KTRIAC_SET_PHASE)
+        set_triac_phase( cfg, config->channel, config->phase);
+
+    if ( config->set & KTRIAC_SET_ANGLE)
+        set_triac_attack_angle( cfg, config->channel, config->value);
+
+    if ( config->set & KTRIAC_SET_PERCENT)
+        set_triac_power( cfg, config->channel, config->value * ( KTRIAC_POWER_STEPS / 100));
+
+    if ( config->set & KTRIAC_SET_POWER)
+        set_triac_power( cfg, config->channel, config->value);
+
+    if ( config->set & KTRIAC_SET_PWM)
+        set_triac_pwm( cfg, config->channel, config->mark, config->space);
+
+    if ( config->set & KTRIAC_SET_BURST)
+        set_triac_burst( cfg, config->channel, config->mark, config->mark + config->space, config->value);
+}
@@ -0,0 +1,563 @@
+/*********************************************
+*** Linux kernel module to drive TRIAC with
+*** Raspberry Pi
+***
+*** Timing core: zerocross gating, mains PLL,
+*** power settings and the gate schedule.
+*** No kernel dependencies, the module and the
+*** simulator drive it through struct ktriac_hw.
+***
+*** Written by The TunguZka Team Hungary
+*** GNU GPLv3 license
+*********************************************/
+
+#ifndef KTRIAC_CORE_H
+#define KTRIAC_CORE_H
+
+#ifdef __KERNEL__
+    #include <linux/kernel.h>
+    #include <linux/types.h>
+    #include <linux/errno.h>
+    #include <linux/string.h>
+    #include <linux/math64.h>
+    #include <linux/bitops.h>
+    #include <asm/barrier.h>
+
+    #define ktriac_info( fmt, ...)      printk( KERN_INFO fmt, ##__VA_ARGS__)
+#else
+    //userspace build: simulator and tools
+    #include <stdbool.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <errno.h>
+    #include <linux/types.h>
+
+    typedef __s64 s64;
+    typedef __u64 u64;
+    typedef __s32 s32;
+    typedef __u32 u32;
+    typedef __u16 u16;
+
+    #define READ_ONCE( x)               ( *( volatile __typeof__( x) *)&( x))
+    #define WRITE_ONCE( x, v)           ( *( volatile __typeof__( x) *)&( x) = ( v))
+    #define xchg( p, v)                 __atomic_exchange_n( p, v, __ATOMIC_SEQ_CST)
+    #define smp_load_acquire( p)        __atomic_load_n( p, __ATOMIC_ACQUIRE)
+    #define smp_store_release( p, v)    __atomic_store_n( p, v, __ATOMIC_RELEASE)
+    #define smp_rmb()                   __atomic_thread_fence( __ATOMIC_ACQUIRE)
+    #define smp_wmb()                   __atomic_thread_fence( __ATOMIC_RELEASE)
+    #define clamp( v, lo, hi)           ({ __typeof__( v) _v = ( v); ( _v < ( lo)) ? ( lo) : ( _v > ( hi)) ? ( hi) : _v; })
+
+    static inline s64 div_s64( s64 dividend, s32 divisor) { return dividend / divisor; }
+    static inline u64 div_u64( u64 dividend, u32 divisor) { return dividend / divisor; }
+    static inline u64 div64_u64( u64 dividend, u64 divisor) { return dividend / divisor; }
+    static inline int fls64( u64 x) { return ( x) ? 64 - __builtin_clzll( x) : 0; }
+
+    #define ktriac_info( fmt, ...)      do { } while ( 0)
+
+    //no tracepoints, see ktriac_trace.h
+    #define trace_ktriac_zerocross( ...)    do { } while ( 0)
+    #define trace_ktriac_reject( ...)       do { } while ( 0)
+    #define trace_ktriac_arm( ...)          do { } while ( 0)
+    #define trace_ktriac_gate( ...)         do { } while ( 0)
+    #define trace_ktriac_config( ...)       do { } while ( 0)
+#endif
+
+#include "ktriac.h"
+#include "ktriac_uapi.h"
+
+#if KTRIAC_MAX_CHANNELS > KTRIAC_CONTROL_CHANNELS
+    #error "the control page has KTRIAC_CONTROL_CHANNELS slots"
+#endif
+
+
+#define SEC_IN_US                       1000000
+
+#define KTRIAC_FREQ_WINDOW              ( 1 << KTRIAC_FREQ_SHIFT)
+//the drift limit and the width tolerance in 1/65536, the edge only multiplies
+#define KTRIAC_FREQ_DRIFT_SCALE         ( ( KTRIAC_FREQ_DRIFT << 16) / 100)
+#define KTRIAC_WIDTH_SCALE              ( ( KTRIAC_WIDTH_TOLERANCE << 16) / 100)
+
+#define OFF     0
+#define ON      1
+//schedule event: the expected zerocross did not come
+#define COAST   2
+
+extern const int angle_to_percent_table[ 181];
+extern const u16 default_power_curve[ KTRIAC_POWER_STEPS + 1];
+
+#define KTRIAC_ENERGY_STEPS             256
+extern const u32 energy_curve[ KTRIAC_ENERGY_STEPS + 1];
+
+/*
+ * Power settings of one channel, times in ns
+ */
+struct triac_setting {
+    int angle;
+    //set in 1/KTRIAC_POWER_STEPS, -1: angle or pwm mode
+    int power;
+    //sigma-delta burst mode: on burstNum of every burstDen half phases,
+    //fullCycle: whole cycles only
+    unsigned int burst, burstNum, burstDen, fullCycle;
+    s64 triggerDelay;
+    s64 fireTime;
+    unsigned int mark, space;
+    unsigned int duty;
+    //counts the changes, the edge compares it with the one it has seen
+    unsigned int changed;
+    //segments of the ramp in ramps, rampStart counts the (re)starts
+    unsigned int rampCount;
+    unsigned int rampStart;
+    //three phase mode: fires from the zerocross of this phase, 0: L1
+    unsigned int phase;
+    //rated power of the load in W: a burst or pwm channel with it is in the load group
+    unsigned int load;
+};
+
+/*
+ * One prepared segment of a power ramp: goes from -> to in steps,
+ * stepTime ns apart, taken on the zerocrosses. inc is in 1/256 %.
+ */
+struct ramp_segment {
+    int from, to, inc;
+    unsigned int steps, startStep;
+    s64 stepTime;
+};
+
+/*
+ * Speed control settings, gains in 1/65536 power step per rpm
+ */
+struct speed_setting {
+    //struct ktriac_speed as given, for reading back
+    struct ktriac_speed config;
+    s64 kp, ki, kd;
+    //counts the changes: the controller starts from 0 at the next zerocross
+    unsigned int reset;
+};
+
+/*
+ * Every setting of the module. The edge works on an immutable snapshot,
+ * a new one is taken over as a whole at a zerocross.
+ */
+struct ktriac_settings {
+    //freqAuto: detect 50 or 60Hz, the tables are built for ac_freq and scaled to the mains
+    unsigned int ac_freq, freqAuto;
+    //counts the changes of the frequency: the measurement starts again
+    unsigned int freqChanged;
+    //AC freq tolerance in %: great if your zerocrossing circuit noisy is.
+    int tolerance;
+    //tolerance in 1/65536
+    u32 toleranceScale;
+    //2^48 / the half phase of ac_freq in ns: the edge scales the gate delays by multiplying
+    u64 halfPhaseInverse;
+    //ns of one degree of the half phase of ac_freq in 1/65536: angle delays without a division
+    u32 angleScale;
+    unsigned int freqTimeLowerBound, freqTimeUpperBound;
+    s64 zeroCrossLatency, halfPhase;
+    //the latency was set from the end of the half phase
+    unsigned int latencyFromEnd;
+    struct triac_setting channel[ KTRIAC_MAX_CHANNELS];
+    //gate delay in ns of every power step for ac_freq, built from powerCurve
+    const u16 *powerCurve;
+    u32 powerDelay[ KTRIAC_POWER_STEPS + 1];
+    struct speed_setting speed;
+    //channel to calibrate, -1: none; calibStart counts the (re)starts
+    int calibChannel;
+    unsigned int calibStart;
+    //ramps of the channels
+    struct ramp_segment ramps[ KTRIAC_MAX_CHANNELS][ KTRIAC_MAX_RAMP];
+    //load group, derived by ktriac_core_publish: the members, their rated power, their average
+    //power and the limit to start with in W, groupChanged counts the changes of the members
+    unsigned int groupMembers, groupRated, groupDemand, groupLimit;
+    unsigned int groupChanged;
+};
+
+/*
+ * Log2 histogram of times in ns: bucket b counts [2^(b-1), 2^b), bucket 0 the times <= 0.
+ * Only the edge and the timer add to it, readers and reset don't lock:
+ * a count may get lost while it is being reset, nothing else.
+ */
+#define KTRIAC_HIST_BUCKETS             32
+
+struct ktriac_hist {
+    unsigned int count[ KTRIAC_HIST_BUCKETS];
+};
+
+static inline void hist_add( struct ktriac_hist *hist, s64 ns)
+{
+    unsigned int bucket = ( ns > 0) ? fls64( ns) : 0;
+
+    if ( bucket >= KTRIAC_HIST_BUCKETS)
+        bucket = KTRIAC_HIST_BUCKETS - 1;
+
+    hist->count[ bucket]++;
+}
+
+static inline void hist_reset( struct ktriac_hist *hist)
+{
+    unsigned int i;
+
+    for ( i = 0; i < KTRIAC_HIST_BUCKETS; ++i)
+        WRITE_ONCE( hist->count[ i], 0);
+}
+
+/*
+ * Tachometer and PID state, integral in 1/65536 power step.
+ * The tacho irq and the edge must not run concurrently.
+ */
+struct speed_control {
+    s64 lastPulse, windowStart;
+    unsigned int pulses, windowPulses, glitches;
+    s64 period;
+    //reset of the settings seen last
+    unsigned int reset;
+    unsigned int rpm, lastRpm;
+    int error, output;
+    s64 integral;
+};
+
+//calibration states
+#define CALIB_OFF                       0
+#define CALIB_LATENCY                   1
+#define CALIB_FIRE                      2
+#define CALIB_DONE                      3
+#define CALIB_FAILED                    4
+
+/*
+ * Calibration of the latency and the gate pulse on the load current sense input.
+ * Every second half phase fires, the one after it only waits for the end of the
+ * conduction: at the next zerocross the fired one is evaluated.
+ * The sense irq and the edge must not run concurrently.
+ */
+struct calibration {
+    unsigned int state, channel;
+    //start of the settings seen last
+    unsigned int start;
+    //a half phase fired at fireZc is being measured (2: fired, 1: waiting after it),
+    //the sense input went high, then low at endAt
+    unsigned int planned, conducted, ended;
+    s64 fireZc, endAt;
+    //fired and good half phases of the current step
+    unsigned int count, good;
+    //latency samples in ns
+    s64 sum, min, max;
+    //gate pulse tried in ns
+    s64 fireTime;
+    //results: latency in us like the kus setting (< 0: from the end of the half phase), gate pulse in ns
+    int latency;
+    s64 fireResult;
+    unsigned int senseEdges;
+};
+
+/*
+ * One TRIAC output. Every channel is driven from the same zerocrossing irq
+ * and the same timer.
+ */
+struct triac_channel {
+    unsigned int status;
+    //pwm: half phases of the period, burst: parity of the half phase
+    unsigned int counter;
+    //sigma-delta burst and the load group: the duty accumulated and the decision
+    unsigned int burstAcc, burstOn;
+    s64 fired, released;
+    //running ramp, overrides the angle of the settings.
+    //rampAngle: -1 off, 0 full on, 1 fire at rampDelay
+    unsigned int rampActive;
+    unsigned int rampSegment, rampStep;
+    //ns to the next step, counted down by the measured half periods
+    s64 rampTime;
+    int rampPercent, rampAngle;
+    s64 rampDelay;
+    //gate on: behind its planned time, after the edge (or coast) planning it
+    struct ktriac_hist histLate, histFire;
+    //delivered energy in ns of full power from the real gate on times, length of the
+    //half phases counted in ns, the half phases counted and the ones that conducted
+    u64 energy, energyTime, halfPhases, conducted;
+    //the changed & rampStart of the settings seen last
+    unsigned int changed, rampStart;
+    //setpoint of the control page taken last: its sequence, KTRIAC_SETPOINT_* type, value, duty in %
+    unsigned int setpointSeq, setpointType, setpointDuty;
+    int setpointValue;
+};
+
+/*
+ * Waveform playback of a channel, see ktriac_uapi.h. The writer fills the buffer
+ * at fill while it is WAVE_FREE and queues it, the edge plays the buffer at playing
+ * and frees it when done: both go round the two buffers in the same order.
+ */
+#define WAVE_FREE       0
+#define WAVE_READY      1
+#define WAVE_PLAYING    2
+
+struct wave_buffer {
+    struct ktriac_wave_entry entry[ KTRIAC_WAVE_SIZE];
+    unsigned int count, flags;
+    unsigned int state;
+};
+
+struct wave_player {
+    struct wave_buffer buffer[ 2];
+    unsigned int playing, position, active;
+    unsigned int fill;
+    unsigned int underruns;
+    u64 played;
+};
+
+/*
+ * Gate on/off event of a channel in the timer schedule
+ */
+struct triac_event {
+    s64 time;
+    unsigned int channel;
+    unsigned int action;
+};
+
+/*
+ * Three phase mode: the zerocross of a phase is offset ns after the one of L1 (within a
+ * half phase: L2 2/3, L3 1/3 of it), expected is derived from freqPeriod. With phase
+ * inputs the offset is measured from the edges: good counts the ones at the expected
+ * place, reversed the ones at the place of the other phase, both up to KTRIAC_PHASE_CHECK.
+ */
+#define KTRIAC_PHASES                   3
+
+//faults of a phase
+#define PHASE_LOST                      ( 1 << 0)
+#define PHASE_REVERSED                  ( 1 << 1)
+
+struct triac_phase {
+    s64 offset, expected;
+    //last edge of the input, 0: none since the PLL locked
+    s64 last;
+    unsigned int good, reversed;
+    unsigned int edges, rejected;
+    //PHASE_* faults at the last zerocross
+    unsigned int fault;
+};
+
+//events of the current and at most one late half phase of every channel
+#define SCHEDULE_SIZE                   ( KTRIAC_MAX_CHANNELS * 4)
+
+/*
+ * What the core needs from the platform, every call gets ctx.
+ * gate switches an output, arm (re)starts the one-shot timer at an absolute
+ * time, emit reports an event (optional).
+ */
+struct ktriac_hw {
+    void (*gate)( void *ctx, unsigned int channel, unsigned int on);
+    void (*arm)( void *ctx, s64 expires);
+    void (*emit)( void *ctx, const struct ktriac_event *event);
+};
+
+//reports of the edge and the timer, the platform prints them out of the irq
+#define REPORT_OUT_OF_FREQ              ( 1 << 0)
+#define REPORT_MAINS_LOST               ( 1 << 1)
+#define REPORT_MAINS_BACK               ( 1 << 2)
+//the calibration ended, done or failed
+#define REPORT_CALIBRATED               ( 1 << 3)
+//a phase got lost or the sequence is reversed, the phases are all right again
+#define REPORT_PHASE_FAULT              ( 1 << 4)
+#define REPORT_PHASE_BACK               ( 1 << 5)
+
+//settingsMiddle holds a snapshot not taken over yet
+#define SETTINGS_FRESH                  4
+
+/*
+ * State of one module instance. Times are CLOCK_MONOTONIC ns.
+ * ktriac_core_edge and ktriac_core_timer must not run concurrently.
+ * The edge takes no lock: the writers, serialized by the platform, change
+ * staged and publish a copy of it with ktriac_core_publish.
+ */
+struct ktriac_core {
+    const struct ktriac_hw *hw;
+    void *ctx;
+
+    struct triac_channel channels[ KTRIAC_MAX_CHANNELS];
+    unsigned int channelCount;
+
+    /*
+     * Triple buffered settings: the edge uses settingsBuf[ settingsFront] through
+     * settings, the writer fills settingsBuf[ settingsBack] and swaps it with
+     * settingsMiddle. At a zerocross the edge swaps its front with a fresh middle.
+     */
+    const struct ktriac_settings *settings;
+    struct ktriac_settings settingsBuf[ 3];
+    unsigned int settingsFront, settingsMiddle, settingsBack;
+    //settings written by the control interfaces, published as a whole
+    struct ktriac_settings staged;
+
+    //waveforms of the channels, waveFreed counts the buffers given back to the writers
+    struct wave_player wave[ KTRIAC_MAX_CHANNELS];
+    unsigned int waveFreed;
+
+    struct speed_control speed;
+    struct calibration calib;
+
+    /*
+     * Three phase mode, L1 is the zerocross input. phaseInputs: L2 and L3 have inputs,
+     * ktriac_core_phase gets their edges. phaseFault stops every channel: a fault or a
+     * phase not confirmed yet, phaseFaults counts the faults.
+     */
+    struct triac_phase phases[ KTRIAC_PHASES];
+    unsigned int phaseInputs, phaseFault, phaseFaults;
+
+    /*
+     * Load group, in W: groupLimit is the total the members are planned within,
+     * groupTotal the one switched on in the current half phase. For the readers: the
+     * highest total and the sum of them in W * half phases since groupHalfPhases was
+     * zeroed. groupChanged: the changes of the settings seen last.
+     */
+    unsigned int groupLimit, groupChanged;
+    unsigned int groupTotal, groupPeak;
+    u64 groupEnergy, groupHalfPhases;
+
+    /*
+     * Control page mapped by userspace, NULL: none. The edge samples the setpoints
+     * and updates the status at every zerocross, see ktriac_uapi.h.
+     */
+    struct ktriac_control_status *controlStatus;
+    const struct ktriac_setpoint *setpoints;
+
+    //power curve of the settings, changed by the writers
+    u16 powerCurve[ KTRIAC_POWER_STEPS + 1];
+
+    //time sorted gate events, shared by the edge and the timer
+    struct triac_event schedule[ SCHEDULE_SIZE];
+    unsigned int scheduleLen, scheduleNext, scheduleOverruns;
+
+    s64 lastRising, lastFalling;
+    /*
+     * Dual edge mode: width of the zerocross pulses in ns, widthDev is the average
+     * absolute deviation. widthCount counts up to KTRIAC_WIDTH_LEARN, widthStreak
+     * the rejected pulses in a row.
+     */
+    s64 widthAvg, widthDev, widthMin, widthMax;
+    unsigned int widthCount, widthStreak, widthRejected;
+    struct ktriac_hist histWidth;
+    //the edge or coast the current half phase was planned at
+    s64 lastPlan;
+    //time between accepted edges, rejected edge since the last accepted one
+    struct ktriac_hist histPeriod, histReject;
+
+    /*
+     * Software PLL tracking the mains: pllNext is the predicted zerocross,
+     * pllPeriod the half period in ns. Firing is scheduled from lastZerocross,
+     * the filtered zerocross, not from the timestamp of the irq.
+     */
+    s64 pllNext, lastZerocross;
+    s64 pllPeriod, pllPhaseError;
+    unsigned int pllLocked, pllGood, pllCoasted, pllCoastedTotal;
+
+    /*
+     * Mains frequency measurement: the accepted half periods in ns of the last
+     * KTRIAC_FREQ_WINDOW edges in arrival order and sorted. freqPeriod is their
+     * trimmed mean, freqNominal the half period of the 50/60Hz in use, 0 while detecting.
+     * Derived at every zerocross: the tolerance range around freqPeriod, the latency,
+     * the scale of the gate delays of the settings (freqPeriod / their half phase, Q16)
+     * and freqInverse, 2^48 / freqPeriod for the energy.
+     */
+    s64 freqSamples[ KTRIAC_FREQ_WINDOW], freqSorted[ KTRIAC_FREQ_WINDOW];
+    unsigned int freqCount, freqNext, freqChanged;
+    s64 freqPeriod, freqNominal, freqDriftLimit;
+    s64 freqWindow, freqLower, freqUpper, freqLatency;
+    u64 freqScale, freqInverse;
+    //drift: freqPeriod at freqTime, then the last one of at least KTRIAC_FREQ_DRIFT_TIME s,
+    //from freqDriftStart to freqDriftEnd in freqDriftSpan ns. freq_milli and freq_drift
+    //turn them into mHz and mHz/s for the readers, the edge does not divide.
+    s64 freqDriftFrom, freqTime, freqDriftStart, freqDriftEnd, freqDriftSpan;
+    //edges by KTRIAC_REASON_*: the rejected ones and the late accepted ones
+    unsigned int reasons[ KTRIAC_REASON_WIDTH + 1];
+
+    /*
+     * REPORT_* flags not taken by the platform yet, it clears them.
+     * reportDelta is the us between the last out of freq edges.
+     */
+    unsigned int reports;
+    s64 reportDelta;
+    unsigned int outOfFreq, mainsLost;
+};
+
+static inline bool is_triac_on( struct triac_channel *ch)
+{
+    return ( ch->status);
+}
+
+static inline void triac( struct ktriac_core *core, unsigned int index, unsigned int value)
+{
+    core->hw->gate( core->ctx, index, value);
+    core->channels[ index].status = value;
+}
+
+/*
+ * ns / 1000 for the edge: a multiply for the times below 2^32 ns, the exact
+ * reciprocal of 1000 for 32 bits. Longer ones are the mains coming back.
+ */
+static inline s64 ns_to_us( s64 ns)
+{
+    if ( ns >= 0 && ns < ( 1LL << 32))
+        return ( (u64)ns * 274877907ULL) >> 38;
+
+    return div_s64( ns, 1000);
+}
+
+//mains frequency of a half phase of us
+static inline unsigned int calc_freq(unsigned int us)
+{
+    unsigned int v, r;
+    v = SEC_IN_US / (us * 2);
+    r = SEC_IN_US % (us * 2);
+
+    return ( r >= us) ? ++v : v;
+}
+
+void ktriac_core_init( struct ktriac_core *core, const struct ktriac_hw *hw, void *ctx, unsigned int channelCount);
+unsigned int ktriac_core_edge( struct ktriac_core *core, s64 now);
+unsigned int ktriac_core_pulse( struct ktriac_core *core, s64 now, unsigned int level);
+s64 ktriac_core_timer( struct ktriac_core *core, s64 now, s64 mergeWindow);
+void ktriac_core_tacho( struct ktriac_core *core, s64 now);
+void ktriac_core_sense( struct ktriac_core *core, s64 now, unsigned int level);
+void ktriac_core_phase_inputs( struct ktriac_core *core);
+void ktriac_core_phase( struct ktriac_core *core, unsigned int index, s64 now);
+void ktriac_core_control( struct ktriac_core *core, struct ktriac_control_status *status, const struct ktriac_setpoint *setpoints);
+void ktriac_core_publish( struct ktriac_core *core);
+unsigned int energy_ppm( u64 energy, u64 time);
+s64 freq_milli( const struct ktriac_core *core);
+s64 freq_drift( const struct ktriac_core *core);
+
+/*
+ * The set_* functions change the staged settings, call them from
+ * the writer and ktriac_core_publish after.
+ */
+void set_triac_attack_angle( struct ktriac_settings *cfg, unsigned int index, int angle_deg);
+void set_triac_power( struct ktriac_settings *cfg, unsigned int index, int power);
+void set_triac_pwm( struct ktriac_settings *cfg, unsigned int index, int m, int s);
+void set_triac_burst( struct ktriac_settings *cfg, unsigned int index, unsigned int num, unsigned int den, unsigned int flags);
+void set_ac_frequent( struct ktriac_settings *cfg, int freq);
+void set_zerocross_latency( struct ktriac_settings *cfg, int value);
+void set_tolerance( struct ktriac_settings *cfg, int value);
+void set_triac_phase( struct ktriac_settings *cfg, unsigned int index, unsigned int phase);
+void set_triac_load( struct ktriac_settings *cfg, unsigned int index, unsigned int load);
+
+int power_curve_check( const u16 *curve);
+void set_power_curve( struct ktriac_core *core, const u16 *curve);
+
+int ramp_check( const struct ktriac_ramp_segment *segments, unsigned int count);
+void set_triac_ramp( struct ktriac_core *core, struct ktriac_settings *cfg, unsigned int index,
+                     const struct ktriac_ramp_segment *segments, unsigned int count, int actual);
+
+/*
+ * Waveform writer: only one at a time. Fill the buffer wave_buffer returns
+ * (NULL: none is free), check it, then queue it. wave_stop must not run
+ * concurrently with the edge.
+ */
+struct wave_buffer *wave_buffer( struct ktriac_core *core, unsigned int index);
+int wave_check( const struct ktriac_wave_entry *entries, unsigned int count);
+void wave_queue( struct ktriac_core *core, unsigned int index, unsigned int count, unsigned int flags);
+void wave_stop( struct ktriac_core *core, unsigned int index);
+
+int speed_check( struct ktriac_core *core, const struct ktriac_speed *speed);
+void set_speed( struct ktriac_settings *cfg, const struct ktriac_speed *speed);
+void set_calibration( struct ktriac_settings *cfg, int channel);
+
+int config_check( struct ktriac_core *core, const struct ktriac_config *config);
+void config_apply( struct ktriac_settings *cfg, const struct ktriac_config *config);
+
+#endif
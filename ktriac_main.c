@@ -0,0 +1,2340 @@
+/*********************************************
+*** Linux kernel module to drive TRIAC with
+*** Raspberry Pi
+***
+*** Written by The TunguZka Team Hungary
+*** GNU GPLv3 license
+*********************************************/
+
+
+#include <linux/device.h>
+#include <linux/miscdevice.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/gpio.h>
+#include <linux/interrupt.h>
+#include <linux/poll.h>
+#include <linux/ktime.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/irq_work.h>
+#include <linux/cpumask.h>
+#include <linux/version.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/ratelimit.h>
+#include <uapi/linux/sched/types.h>
+#include "ktriac.h"
+#include "ktriac_uapi.h"
+#include "ktriac_core.h"
+
+#ifdef DEBUG_DEVICE
+    //the records start on their own cache line after the header
+    #define RING_EVENTS_OFFSET          64
+    #define RING_BYTES                  PAGE_ALIGN( RING_EVENTS_OFFSET + KTRIAC_RING_SIZE * sizeof( struct ktriac_event))
+
+    static wait_queue_head_t waitqueue;
+    static struct ktriac_ring_header *ring;
+    static struct ktriac_event *ringEvents;
+    static unsigned int ringHead;
+#endif
+
+//the timer callback runs in hard irq context on PREEMPT_RT as well
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 5, 4, 0)
+    #define KTRIAC_HRTIMER_MODE         HRTIMER_MODE_ABS_HARD
+#else
+    #define KTRIAC_HRTIMER_MODE         HRTIMER_MODE_ABS
+#endif
+
+static struct hrtimer hr_timer;
+//KTRIAC_HRTIMER_MODE, pinned to the cpu of the parameter
+static enum hrtimer_mode timerMode = KTRIAC_HRTIMER_MODE;
+static struct ktriac_core core;
+//control page of userspace: the status, the setpoints on the next page
+static struct ktriac_control_status *control;
+
+//serializes the writers of core.staged, the irq and the timer never take it
+static DEFINE_MUTEX( stagedLock);
+//serializes the zerocross irq and the timer in the core
+static DEFINE_RAW_SPINLOCK( scheduleLock);
+
+//waveform writers wait for a free buffer, one writes at a time
+static DECLARE_WAIT_QUEUE_HEAD( waveQueue);
+static DEFINE_MUTEX( waveMutex);
+
+/* Module parameters */
+static int gpios[ KTRIAC_MAX_CHANNELS] = { GPIO_TRIAC };
+static int gpioCount;
+module_param_array( gpios, int, &gpioCount, 0444);
+MODULE_PARM_DESC( gpios, "GPIO pins of the TRIAC outputs, one per channel (default: GPIO_TRIAC)");
+
+static unsigned int merge_window = TRIAC_DEFAULT_MERGE_WINDOW;
+module_param( merge_window, uint, 0644);
+MODULE_PARM_DESC( merge_window, "Gate events closer than this (ns) are handled by one timer interrupt");
+
+static int tacho_gpio = GPIO_TACHO;
+module_param( tacho_gpio, int, 0444);
+MODULE_PARM_DESC( tacho_gpio, "GPIO pin of the tachometer for the speed control, -1: none (default: GPIO_TACHO)");
+
+static int sense_gpio = GPIO_SENSE;
+module_param( sense_gpio, int, 0444);
+MODULE_PARM_DESC( sense_gpio, "GPIO pin of the load current sense input for the calibration, high while the load conducts, -1: none (default: GPIO_SENSE)");
+
+//the calibration writes its results here: put them to the module options to keep them
+static int zerocross_latency = ZEROCROSS_DEFAULT_LATENCY;
+module_param( zerocross_latency, int, 0644);
+MODULE_PARM_DESC( zerocross_latency, "Zerocross latency in us at loading, < 0: from the end of the half phase (default: ZEROCROSS_DEFAULT_LATENCY)");
+
+static unsigned int fire_time = TRIAC_DEFAULT_FIRE_TIME / 1000;
+module_param( fire_time, uint, 0644);
+MODULE_PARM_DESC( fire_time, "Gate pulse of every channel in us at loading (default: TRIAC_DEFAULT_FIRE_TIME)");
+
+static bool three_phase;
+module_param( three_phase, bool, 0444);
+MODULE_PARM_DESC( three_phase, "Three phase mode: channel N is on phase L(N % 3 + 1), the zerocross input is L1");
+
+//the zerocross inputs of L2 and L3, without them the phases are derived from L1
+static int phase_gpios[ KTRIAC_PHASES - 1];
+static int phaseGpioCount;
+module_param_array( phase_gpios, int, &phaseGpioCount, 0444);
+MODULE_PARM_DESC( phase_gpios, "GPIO pins of the zerocross inputs of L2 and L3: phase sequence and lost phase check (default: none)");
+
+static bool dual_edge;
+module_param( dual_edge, bool, 0444);
+MODULE_PARM_DESC( dual_edge, "Both edges of the zerocross pulse: the zerocross is its middle, set the latency to 0");
+
+//the raw edges are needed to replay the irqs offline, see replay/
+static bool capture;
+module_param( capture, bool, 0644);
+MODULE_PARM_DESC( capture, "Record the raw edges of the zerocross input in the event ring (DEBUG_DEVICE)");
+
+static bool threaded;
+module_param( threaded, bool, 0444);
+MODULE_PARM_DESC( threaded, "Threaded zerocross irq: the hard irq only takes the timestamp (use it on PREEMPT_RT)");
+
+static int irq_priority = KTRIAC_IRQ_PRIORITY;
+module_param( irq_priority, int, 0444);
+MODULE_PARM_DESC( irq_priority, "SCHED_FIFO priority of the zerocross irq thread, 0: kernel default (default: KTRIAC_IRQ_PRIORITY)");
+
+static int cpu = -1;
+module_param( cpu, int, 0444);
+MODULE_PARM_DESC( cpu, "Run the zerocross irq and the timer on this (isolated) cpu, -1: anywhere");
+
+/* Define GPIOs & Irq: the zerocrossing input followed by the channel outputs */
+static struct gpio pins[ KTRIAC_MAX_CHANNELS + 1] = {
+                { GPIO_ACFREQ, GPIOF_IN, "AC Signal" },
+};
+
+static int ac_irqs[] = { -1 };
+static int tacho_irq = -1;
+static int sense_irq = -1;
+static int phase_irqs[ KTRIAC_PHASES - 1] = { -1, -1 };
+
+/*
+ * Timestamps of the threaded irq: the hard handler writes them,
+ * the irq thread consumes them. Edges closer than the thread can follow are lost.
+ */
+#define STAMP_SIZE                      8
+
+struct stamp {
+    s64 time;
+    //input after the edge in dual edge mode
+    unsigned int level;
+};
+
+static struct stamp stamps[ STAMP_SIZE];
+static unsigned int stampHead, stampTail, stampOverruns;
+static bool threadTuned;
+
+/*
+ * Work of the irq and the timer done later: wakeups through an irq_work,
+ * reports from a workqueue. Bits of deferPending, set by defer().
+ */
+#define DEFER_RING                      ( 1 << 0)
+#define DEFER_WAVE                      ( 1 << 1)
+#define DEFER_REPORT                    ( 1 << 2)
+
+static atomic_t deferPending;
+static struct irq_work deferWork;
+static struct work_struct reportWork;
+
+//at most 10 reports in 5 seconds, the rest is counted only
+static DEFINE_RATELIMIT_STATE( reportLimit, 5 * HZ, 10);
+static unsigned int reportsSuppressed;
+
+
+// PLATFORM OF THE CORE
+
+static void hw_gate( void *ctx, unsigned int channel, unsigned int on)
+{
+    gpio_set_value( pins[ channel + 1].gpio, on);
+}
+
+static void hw_arm( void *ctx, s64 expires)
+{
+    hrtimer_start( &hr_timer, ns_to_ktime( expires), timerMode);
+}
+
+#ifdef DEBUG_DEVICE
+/*
+ * Append an event to the ring, called with scheduleLock held
+ */
+static void ring_put( void *ctx, const struct ktriac_event *event)
+{
+    unsigned int head = ringHead + 1;
+
+    ringEvents[ ringHead & ( KTRIAC_RING_SIZE - 1)] = *event;
+    
+    //publish the record, then make the new head visible before the next slot gets overwritten.
+    //The readers of the kernel take the private head, the mapped one is only a copy for userspace.
+    smp_store_release( &ringHead, head);
+    smp_store_release( &ring->head, head);
+    smp_wmb();
+}
+
+/*
+ * Raw edge of a zerocross input for a capture, called with scheduleLock held.
+ * phase is 0 for the zerocross input, 1 and 2 for the inputs of L2 and L3.
+ */
+static void ring_edge( s64 now, unsigned int phase, unsigned int level)
+{
+    struct ktriac_event event;
+
+    memset( &event, 0, sizeof( event));
+    event.timestamp = now;
+    event.type = KTRIAC_EVENT_EDGE;
+    event.channel = phase;
+    event.data = level;
+
+    ring_put( NULL, &event);
+}
+
+#endif
+
+static const struct ktriac_hw hw = {
+    .gate = hw_gate,
+    .arm = hw_arm,
+#ifdef DEBUG_DEVICE
+    .emit = ring_put,
+#endif
+};
+
+/*
+ * DEFER_* work left by a call into the core, called with scheduleLock held
+ * with the ring head and the freed buffers from before the call
+ */
+static unsigned int core_deferred( unsigned int head, unsigned int freed)
+{
+    unsigned int what = 0;
+
+#ifdef DEBUG_DEVICE
+    if ( ringHead != head)
+        what |= DEFER_RING;
+#endif
+    if ( core.waveFreed != freed)
+        what |= DEFER_WAVE;
+    if ( core.reports)
+        what |= DEFER_REPORT;
+
+    return what;
+}
+
+/*
+ * Queue the DEFER_* work, the wakeups only if somebody waits.
+ * Repeated calls before the irq_work runs cost only the flags.
+ */
+static void defer( unsigned int what)
+{
+#ifdef DEBUG_DEVICE
+    if ( ( what & DEFER_RING) && !wq_has_sleeper( &waitqueue))
+        what &= ~DEFER_RING;
+#endif
+    if ( ( what & DEFER_WAVE) && !wq_has_sleeper( &waveQueue))
+        what &= ~DEFER_WAVE;
+
+    if ( !what)
+        return;
+
+    atomic_or( what, &deferPending);
+    irq_work_queue( &deferWork);
+}
+
+static void defer_run( struct irq_work *work)
+{
+    unsigned int what = atomic_xchg( &deferPending, 0);
+
+#ifdef DEBUG_DEVICE
+    if ( what & DEFER_RING)
+        wake_up( &waitqueue);
+#endif
+    if ( what & DEFER_WAVE)
+        wake_up( &waveQueue);
+    if ( what & DEFER_REPORT)
+        schedule_work( &reportWork);
+}
+
+#define report( fmt, ...)                                               \
+    do {                                                                \
+        if ( __ratelimit( &reportLimit))                                \
+            printk( KERN_INFO fmt, ##__VA_ARGS__);                      \
+        else                                                            \
+            ++reportsSuppressed;                                        \
+    } while ( 0)
+
+/*
+ * Take over the results of a finished calibration: the settings of the channel
+ * and the module parameters, the next loading starts with them if they are kept
+ */
+static void calib_apply( void)
+{
+    struct calibration cal;
+    unsigned long flags;
+
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+    cal = core.calib;
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+
+    if ( cal.state != CALIB_DONE)
+    {
+        printk(KERN_INFO "ktriac: calibration of channel %u failed, check the sense input and the gate pulse\n", cal.channel);
+        return;
+    }
+
+    mutex_lock( &stagedLock);
+    set_zerocross_latency( &core.staged, cal.latency);
+    core.staged.channel[ cal.channel].fireTime = cal.fireResult;
+    ktriac_core_publish( &core);
+    mutex_unlock( &stagedLock);
+
+    zerocross_latency = cal.latency;
+    fire_time = div_s64( cal.fireResult, 1000);
+
+    printk(KERN_INFO "ktriac: channel %u calibrated: zerocross_latency=%d fire_time=%u\n", cal.channel, zerocross_latency, fire_time);
+}
+
+/*
+ * Print the reports of the core, several of a kind since the last run make one line
+ */
+static void report_run( struct work_struct *work)
+{
+    unsigned int reports, ac_freq;
+    unsigned long flags;
+    s64 delta;
+
+    //the settings of the irq go back to the writers at the next swap: read them under the lock
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+    reports = core.reports;
+    delta = core.reportDelta;
+    ac_freq = core.settings->ac_freq;
+    core.reports = 0;
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+
+    if ( reports & REPORT_OUT_OF_FREQ)
+        report( "ktriac: irq out of freq: %d Hz delta: %lld us calc_freq: %d Hz\n", ac_freq, delta, calc_freq( delta));
+    if ( reports & REPORT_MAINS_LOST)
+        report( "ktriac: mains lost\n");
+    if ( reports & REPORT_MAINS_BACK)
+        report( "ktriac: locked to the mains\n");
+    if ( reports & REPORT_CALIBRATED)
+        calib_apply();
+    if ( reports & REPORT_PHASE_FAULT)
+        report( "ktriac: phase fault: L2%s%s L3%s%s, the outputs are off\n",
+                ( core.phases[ 1].fault & PHASE_LOST) ? " lost" : "", ( core.phases[ 1].fault & PHASE_REVERSED) ? " reversed" : "",
+                ( core.phases[ 2].fault & PHASE_LOST) ? " lost" : "", ( core.phases[ 2].fault & PHASE_REVERSED) ? " reversed" : "");
+    if ( reports & REPORT_PHASE_BACK)
+        report( "ktriac: the phases are all right\n");
+}
+
+/*
+ * Edge of the zerocross input to the core, returns the DEFER_* work left
+ */
+static unsigned int zerocross_input( s64 now, unsigned int level)
+{
+        unsigned int freed, what;
+        unsigned int head = 0;
+        unsigned long flags;
+
+        //irqsave: on PREEMPT_RT the irq handler is forced into a thread, the hard timer may interrupt it
+        raw_spin_lock_irqsave( &scheduleLock, flags);
+        freed = core.waveFreed;
+#ifdef DEBUG_DEVICE
+        head = ringHead;
+#endif
+
+#ifdef DEBUG_DEVICE
+        if ( READ_ONCE( capture))
+            ring_edge( now, 0, level);
+#endif
+
+        if ( dual_edge)
+            ktriac_core_pulse( &core, now, level);
+        else
+            ktriac_core_edge( &core, now);
+
+        what = core_deferred( head, freed);
+        raw_spin_unlock_irqrestore( &scheduleLock, flags);
+
+        return what;
+}
+
+/*
+ * The interrupt service routine called on zerocrossing pin event:
+ * timestamp, gating and timer arming, the rest is deferred
+ */
+static irqreturn_t zerocross_trigger_isr(int irq, void *data)
+{
+        ktime_t now = ktime_get();
+
+        defer( zerocross_input( ktime_to_ns( now), ( dual_edge) ? gpio_get_value( pins[0].gpio) : 1));
+
+        return IRQ_HANDLED;
+}
+
+/*
+ * Tachometer pulse: short enough to run in hard irq context on PREEMPT_RT too
+ */
+static irqreturn_t tacho_isr( int irq, void *data)
+{
+    s64 now = ktime_to_ns( ktime_get());
+    unsigned long flags;
+    
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+    ktriac_core_tacho( &core, now);
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+    
+    return IRQ_HANDLED;
+}
+
+/*
+ * Load current sense input, both edges: only while calibrating it has something to do
+ */
+static irqreturn_t sense_isr( int irq, void *data)
+{
+    s64 now = ktime_to_ns( ktime_get());
+    unsigned int level = gpio_get_value( sense_gpio);
+    unsigned long flags;
+
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+    ktriac_core_sense( &core, now, level);
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+
+    return IRQ_HANDLED;
+}
+
+/*
+ * Zerocross input of L2 or L3 (data points to its irq): serialized with
+ * the other inputs and the timer by scheduleLock like the tacho
+ */
+static irqreturn_t phase_isr( int irq, void *data)
+{
+    unsigned int phase = (int *)data - phase_irqs + 1;
+    s64 now = ktime_to_ns( ktime_get());
+    unsigned int head = 0;
+    unsigned long flags;
+    unsigned int what;
+
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+#ifdef DEBUG_DEVICE
+    head = ringHead;
+    if ( READ_ONCE( capture))
+        ring_edge( now, phase, 1);
+#endif
+    ktriac_core_phase( &core, phase, now);
+    what = core_deferred( head, core.waveFreed);
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+
+    defer( what);
+
+    return IRQ_HANDLED;
+}
+
+/*
+ * Hard part of the threaded zerocross irq: the timestamp only
+ */
+static irqreturn_t zerocross_stamp_isr( int irq, void *data)
+{
+    unsigned int head = stampHead;
+    
+    if ( head - READ_ONCE( stampTail) >= STAMP_SIZE)
+    {
+        ++stampOverruns;
+        return IRQ_WAKE_THREAD;
+    }
+    
+    stamps[ head & ( STAMP_SIZE - 1)].time = ktime_to_ns( ktime_get());
+    stamps[ head & ( STAMP_SIZE - 1)].level = ( dual_edge) ? gpio_get_value( pins[0].gpio) : 1;
+    smp_store_release( &stampHead, head + 1);
+    
+    return IRQ_WAKE_THREAD;
+}
+
+/*
+ * The irq thread gives every timestamp to the core
+ */
+static irqreturn_t zerocross_thread_isr( int irq, void *data)
+{
+    unsigned int tail = stampTail;
+    unsigned int what = 0;
+    
+    if ( !threadTuned && irq_priority > 0)
+    {
+        struct sched_attr attr = {
+            .size = sizeof( attr),
+            .sched_policy = SCHED_FIFO,
+            .sched_priority = irq_priority,
+        };
+        
+        if ( sched_setattr_nocheck( current, &attr))
+            printk(KERN_INFO "ktriac: cannot set the irq thread priority to %d\n", irq_priority);
+    }
+    threadTuned = true;
+    
+    while ( tail != smp_load_acquire( &stampHead))
+    {
+        struct stamp *stamp = &stamps[ tail & ( STAMP_SIZE - 1)];
+        
+        what |= zerocross_input( stamp->time, stamp->level);
+        smp_store_release( &stampTail, ++tail);
+    }
+    
+    defer( what);
+    
+    return IRQ_HANDLED;
+}
+
+/*
+ * Timer callback: the core switches every gate due until now + merge_window,
+ * then it rearms itself to the next event of the schedule.
+ */
+static enum hrtimer_restart triac_fire( struct hrtimer *timer)
+{
+    enum hrtimer_restart ret = HRTIMER_NORESTART;
+    unsigned int head = 0, freed, what;
+    unsigned long flags;
+    s64 next;
+    
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+    
+#ifdef DEBUG_DEVICE
+    head = ringHead;
+#endif
+    freed = core.waveFreed;
+    next = ktriac_core_timer( &core, ktime_to_ns( ktime_get()), READ_ONCE( merge_window));
+    
+    //the zerocross irq may have restarted us meanwhile with a new schedule
+    if ( next && !hrtimer_is_queued( timer))
+    {
+        hrtimer_set_expires( timer, ns_to_ktime( next));
+        ret = HRTIMER_RESTART;
+    }
+    
+    //the PLL coasted or lost the mains
+    what = core_deferred( head, freed);
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+
+    defer( what);
+
+    return ret;
+}
+
+/*
+ * Parse "ramp [-n [NUM]] [from]%-[to]%-[step]%-[time in ms]..." like the ramp utility
+ */
+static int triac_store_ramp( unsigned int index, const char *buf)
+{
+    struct ktriac_ramp_segment segments[ KTRIAC_MAX_RAMP];
+    unsigned int count = 0;
+    int actual = -1;
+    char *copy, *cursor, *token;
+    int ret = 0;
+    
+    copy = kstrdup( buf, GFP_KERNEL);
+    if ( !copy)
+        return -ENOMEM;
+    
+    cursor = copy + strlen( "ramp");
+    
+    while ( ( token = strsep( &cursor, " \t\n")) != NULL)
+    {
+        int from, to, step, time;
+        
+        if ( !*token)
+            continue;
+        
+        if ( strcmp( token, "-n") == 0)
+        {
+            actual = KTRIAC_RAMP_CURRENT;
+            continue;
+        }
+        
+        if ( sscanf( token, "%d%%-%d%%-%d%%-%d", &from, &to, &step, &time) < 4)
+        {
+            //-n NUM: the actual percentage
+            if ( actual == KTRIAC_RAMP_CURRENT && count == 0 && sscanf( token, "%d", &actual) == 1 && actual >= 0 && actual <= 100)
+                continue;
+            
+            ret = -EINVAL;
+            goto out;
+        }
+        
+        if ( count >= KTRIAC_MAX_RAMP || from < 0 || to < 0 || step < 0 || time < 0)
+        {
+            ret = -EINVAL;
+            goto out;
+        }
+        
+        segments[ count].from = from;
+        segments[ count].to = to;
+        segments[ count].step = step;
+        segments[ count].time_ms = time;
+        ++count;
+    }
+    
+    ret = ramp_check( segments, count);
+    if ( ret)
+        goto out;
+    
+    mutex_lock( &stagedLock);
+    set_triac_ramp( &core, &core.staged, index, segments, count, actual);
+    ktriac_core_publish( &core);
+    mutex_unlock( &stagedLock);
+
+out:
+    kfree( copy);
+    return ret;
+}
+
+/*
+ * Parse "burst N:M [full]" or "burst X[.Y]% [full]"
+ */
+static int triac_store_burst( unsigned int index, const char *buf)
+{
+    unsigned int num, space, burstFlags = 0;
+    int value, value2;
+    char c;
+    
+    buf += strlen( "burst");
+    
+    if ( sscanf( buf, "%u:%u", &num, &space) == 2)
+    {
+        if ( num > KTRIAC_BURST_MAX || space > KTRIAC_BURST_MAX || num + space == 0 || num + space > KTRIAC_BURST_MAX)
+            return -EINVAL;
+    }
+    else
+    if ( sscanf( buf, "%d.%1d%c", &value, &value2, &c) == 3 && c == '%')
+    {
+        if ( value < 0 || value > 100 || value2 < 0 || value * 10 + value2 > KTRIAC_POWER_STEPS)
+            return -EINVAL;
+        
+        num = value * 10 + value2;
+        space = KTRIAC_POWER_STEPS - num;
+    }
+    else
+    if ( sscanf( buf, "%d%c", &value, &c) == 2 && c == '%')
+    {
+        if ( value < 0 || value > 100)
+            return -EINVAL;
+        
+        num = value;
+        space = 100 - value;
+    }
+    else
+        return -EINVAL;
+    
+    if ( strstr( buf, "full"))
+        burstFlags |= KTRIAC_BURST_FULL_CYCLE;
+    
+    mutex_lock( &stagedLock);
+    set_triac_burst( &core.staged, index, num, num + space, burstFlags);
+    ktriac_core_publish( &core);
+    mutex_unlock( &stagedLock);
+    
+    return 0;
+}
+
+// SYSFS
+
+inline const char* mains_status_str( void)
+{
+    unsigned long flags;
+    s64 lastRising;
+    unsigned int upper;
+
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+    lastRising = core.lastRising;
+    upper = core.settings->freqTimeUpperBound;
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+    
+    return ( ktime_us_delta( ktime_get(), lastRising) < upper * 2) ? "on" : "off";
+}
+
+static struct kobj_attribute channel_attributes[ KTRIAC_MAX_CHANNELS];
+static char channel_attribute_names[ KTRIAC_MAX_CHANNELS][ 16];
+
+//every channel has its own sysfs file: ktriac, ktriac1, ktriac2...
+static inline unsigned int attr_to_channel( struct kobj_attribute *attr)
+{
+    return attr - channel_attributes;
+}
+
+/*
+ * Phase of the channel and the state of the phases in three phase mode
+ */
+static void phase_show( char *buf, int *count, unsigned int phase)
+{
+    struct triac_phase phases[ KTRIAC_PHASES];
+    unsigned int fault, faults, i;
+    unsigned long flags;
+    s64 period;
+
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+    memcpy( phases, core.phases, sizeof( phases));
+    fault = core.phaseFault;
+    faults = core.phaseFaults;
+    period = core.freqPeriod;
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+
+    *count += sprintf( buf + *count, "Phase: L%u\n", phase + 1);
+
+    //in 0.1 deg, L3 crosses in the other direction within the half phase of L1: 180 deg more
+    for ( i = 1; i < KTRIAC_PHASES; ++i)
+    {
+        s64 angle = div_s64( phases[ i].offset * 1800, period) + ( ( i == 2) ? 1800 : 0);
+        s64 deg = div_s64( angle, 10);
+
+        *count += sprintf( buf + *count, "L%u: %lld.%lld deg%s%s%s\n", i + 1, deg, angle - deg * 10,
+                           ( core.phaseInputs) ? "" : " derived", ( phases[ i].fault & PHASE_LOST) ? " lost" : "",
+                           ( phases[ i].fault & PHASE_REVERSED) ? " reversed" : "");
+    }
+
+    if ( core.phaseInputs)
+        *count += sprintf( buf + *count, "Phases: %s\nPhase faults: %u\nPhase edges rejected: %u/%u\n", ( fault) ? "stopped" : "ok",
+                           faults, phases[ 1].rejected, phases[ 2].rejected);
+}
+
+static ssize_t triac_show(struct kobject *kobj, struct kobj_attribute *attr,
+                      char *buf)
+{
+    unsigned int index = attr_to_channel( attr);
+    struct triac_setting set;
+    unsigned int ac_freq, freqAuto;
+    int tolerance;
+    s64 zeroCrossLatency, nominal, milli, hz;
+    int count = 0;
+    
+    //the staged settings: in effect from the next zerocross
+    mutex_lock( &stagedLock);
+    set = core.staged.channel[ index];
+    ac_freq = core.staged.ac_freq;
+    freqAuto = core.staged.freqAuto;
+    tolerance = core.staged.tolerance;
+    zeroCrossLatency = core.staged.zeroCrossLatency;
+    mutex_unlock( &stagedLock);
+    
+    nominal = READ_ONCE( core.freqNominal);
+    if ( freqAuto && nominal)
+        count += sprintf( buf + count, "Mains: %s\nAC freq: auto %lld\nTolerance: %d\n", mains_status_str(), div_s64( SEC_IN_US * 500LL, nominal), tolerance);
+    else
+    if ( freqAuto)
+        count += sprintf( buf + count, "Mains: %s\nAC freq: auto detecting\nTolerance: %d\n", mains_status_str(), tolerance);
+    else
+        count += sprintf( buf + count, "Mains: %s\nAC freq: %d\nTolerance: %d\n", mains_status_str(), ac_freq, tolerance);
+    milli = freq_milli( &core);
+    hz = div_s64( milli, 1000);
+    count += sprintf( buf + count, "Measured freq: %lld.%03lld Hz\nFreq drift: %lld mHz/s\n", hz, milli - hz * 1000, freq_drift( &core));
+    count += sprintf( buf + count, "Channel: %d/%d GPIO: %d\n", index, core.channelCount, pins[ index + 1].gpio);
+    if ( three_phase || set.phase)
+        phase_show( buf, &count, set.phase);
+    
+    if ( set.burst)
+        count += sprintf( buf + count, "Burst: %u:%u%s\n", set.burstNum, set.burstDen - set.burstNum, ( set.fullCycle) ? " full" : "");
+    else
+    if ( set.mark)
+        count += sprintf( buf + count, "PWM: %d:%d\n", set.mark, set.space);
+    else
+        count += sprintf( buf + count, "Angle: %d deg\n", set.angle);
+    
+    if ( set.power >= 0)
+        count += sprintf( buf + count, "Power: %d.%d%%\n", set.power / 10, set.power % 10);
+
+    if ( set.load)
+        count += sprintf( buf + count, "Load: %u W%s\n", set.load, ( set.burst || set.mark) ? "" : " not in the group");
+    
+    if ( core.channels[ index].rampActive)
+        count += sprintf( buf + count, "Ramp: %d%% segment %d/%d\n", core.channels[ index].rampPercent, core.channels[ index].rampSegment + 1, set.rampCount);
+    
+    count += sprintf( buf + count, "Duty: %d%%\nZeroCrossLatency: %d us\nFireTime: %d us\n", set.duty, (int)zeroCrossLatency, (unsigned int)ktime_to_us( set.fireTime));
+    count += sprintf( buf + count, "Schedule overruns: %u\n", core.scheduleOverruns);
+    if ( threaded)
+        count += sprintf( buf + count, "Timestamp overruns: %u\n", stampOverruns);
+    if ( core.wave[ index].active || core.wave[ index].underruns)
+        count += sprintf( buf + count, "Wave: %s\nWave underruns: %u\n", ( core.wave[ index].active) ? "playing" : "stopped", core.wave[ index].underruns);
+    if ( dual_edge)
+        count += sprintf( buf + count, "Pulse width: %lld us\nPulse width deviation: %lld us\nPulse width min/max: %lld/%lld us\nPulse width rejected: %u\n",
+                          div_s64( core.widthAvg, 1000), div_s64( core.widthDev, 1000), div_s64( core.widthMin, 1000), div_s64( core.widthMax, 1000), core.widthRejected);
+    count += sprintf( buf + count, "PLL: %s\nPLL period: %lld ns\nPLL phase error: %lld ns\nPLL coasted: %u\n",
+                      ( core.pllLocked) ? "locked" : "unlocked", core.pllPeriod, core.pllPhaseError, core.pllCoastedTotal);
+    count += sprintf( buf + count, "Mains lost: %u\nOut of freq: %u\nReports suppressed: %u\n", core.mainsLost, core.outOfFreq, reportsSuppressed);
+    count += sprintf( buf + count, "Rejected glitch/early/width: %u/%u/%u\nAccepted late: %u\n", core.reasons[ KTRIAC_REASON_GLITCH],
+                      core.reasons[ KTRIAC_REASON_EARLY], core.reasons[ KTRIAC_REASON_WIDTH], core.reasons[ KTRIAC_REASON_LATE]);
+    
+    
+    return count;
+}
+
+/*
+ * Rated power of a channel for the load group
+ */
+static int load_commit( const struct ktriac_load *load)
+{
+    if ( load->channel >= core.channelCount || load->power_w > KTRIAC_LOAD_MAX)
+        return -EINVAL;
+
+    mutex_lock( &stagedLock);
+    set_triac_load( &core.staged, load->channel, load->power_w);
+    ktriac_core_publish( &core);
+    mutex_unlock( &stagedLock);
+
+    return 0;
+}
+
+static ssize_t triac_store(struct kobject *kobj, struct kobj_attribute *attr,
+                      const char *buf, size_t count)
+{
+        unsigned int index = attr_to_channel( attr);
+        int value, value2, n;
+        char buffer[128];
+        
+        //HANDLE RAMPS
+        if ( strncmp( buf, "ramp", 4) == 0)
+        {
+            int ret = triac_store_ramp( index, buf);
+            
+            return ( ret) ? ret : count;
+        }
+
+        //HANDLE THE PHASE: phase L1, L2 or L3
+        if ( strncmp( buf, "phase", 5) == 0)
+        {
+            if ( sscanf( buf, "phase L%d", &value) != 1 || value < 1 || value > KTRIAC_PHASES)
+                return -EINVAL;
+
+            mutex_lock( &stagedLock);
+            set_triac_phase( &core.staged, index, value - 1);
+            ktriac_core_publish( &core);
+            mutex_unlock( &stagedLock);
+            return count;
+        }
+
+        //HANDLE THE LOAD GROUP: load W, 0 leaves it
+        if ( strncmp( buf, "load", 4) == 0)
+        {
+            struct ktriac_load load = { .channel = index };
+
+            if ( sscanf( buf, "load %u", &load.power_w) != 1)
+                return -EINVAL;
+
+            n = load_commit( &load);
+            return ( n) ? n : count;
+        }
+
+        //HANDLE SIGMA-DELTA BURST
+        if ( strncmp( buf, "burst", 5) == 0)
+        {
+            int ret = triac_store_burst( index, buf);
+            
+            return ( ret) ? ret : count;
+        }
+
+        //HANDLE PWM MODE
+        if ( sscanf(buf, "%d:%d", &value, &value2) >= 2)
+        {
+            if ( value < 0 || value2 < 0 || value > KTRIAC_BURST_MAX || value2 > KTRIAC_BURST_MAX ||
+                 value + value2 == 0 || value + value2 > KTRIAC_BURST_MAX)
+                return -EINVAL;
+
+            mutex_lock( &stagedLock);
+            set_triac_pwm( &core.staged, index, value, value2);
+            ktriac_core_publish( &core);
+            mutex_unlock( &stagedLock);
+            return count;
+        }
+        
+        
+        //HANDLE POWER IN 0.1%
+        if ( sscanf(buf, "%d.%1d%1s", &value, &value2, &buffer[0]) == 3 && buffer[0] == '%')
+        {
+            if ( value < 0 || value > 100 || value2 < 0)
+                return -EINVAL;
+            
+            mutex_lock( &stagedLock);
+            set_triac_power( &core.staged, index, value * 10 + value2);
+            ktriac_core_publish( &core);
+            mutex_unlock( &stagedLock);
+            return count;
+        }
+        
+        n = sscanf(buf, "%d%127s", &value, &buffer[0]);
+        
+        if ( !n)
+        {
+            printk(KERN_INFO "ktriac: sscanf!!!suck!!!\n");
+            return count;
+        }
+        
+        mutex_lock( &stagedLock);
+        
+        if ( n == 1)
+        {
+            set_triac_attack_angle( &core.staged, index, value);
+        }
+        else
+        {
+            if ( strcmp( &buffer[0], "d") == 0)
+            {
+                set_triac_attack_angle( &core.staged, index, value); 
+            } else
+            //set triac potencial in percentage
+            if ( strcmp( &buffer[0], "%") == 0)
+            {
+                if ( value >= 0 && value <= 100)
+                    set_triac_power( &core.staged, index, value * ( KTRIAC_POWER_STEPS / 100)); 
+            } else
+            //set triacf "on" time of this channel
+            if ( strcmp( &buffer[0], "us") == 0)
+            {
+                if ( value >= 0 && value <= KTRIAC_FIRE_TIME_MAX)
+                    core.staged.channel[ index].fireTime = (s64)value * 1000;
+            } else
+            //set latency time
+            if ( strcmp( &buffer[0], "kus") == 0)
+            {
+                if ( value <= -KTRIAC_LATENCY_MAX || value >= KTRIAC_LATENCY_MAX)
+                {
+                    mutex_unlock( &stagedLock);
+                    return -EINVAL;
+                }
+
+                set_zerocross_latency( &core.staged, value);
+            } else
+            //set frequent
+            if ( strcmp( &buffer[0], "Hz") == 0 || strcmp( &buffer[0], "hz") == 0)
+            {
+                if ( value && ( value < KTRIAC_FREQ_MIN || value > KTRIAC_FREQ_MAX))
+                {
+                    mutex_unlock( &stagedLock);
+                    return -EINVAL;
+                }
+
+                set_ac_frequent( &core.staged, value);
+            } else
+            //set tolerance
+            if ( strcmp( &buffer[0], "t") == 0 || strcmp( &buffer[0], "hz") == 0)
+            {
+                if ( value >=0 && value <= 100)
+                    set_tolerance( &core.staged, value);
+            }
+        }
+        
+        ktriac_core_publish( &core);
+        mutex_unlock( &stagedLock);
+        
+        return count;
+}
+
+/*
+ * /sys/ktriac/curve: the power curve, see ktriac_uapi.h
+ */
+static ssize_t curve_read( struct file *file, struct kobject *kobj, struct bin_attribute *attr,
+                           char *buf, loff_t off, size_t count)
+{
+    
+    if ( off >= sizeof( core.powerCurve))
+        return 0;
+    
+    count = min_t( size_t, count, sizeof( core.powerCurve) - off);
+    
+    mutex_lock( &stagedLock);
+    memcpy( buf, (char *)core.powerCurve + off, count);
+    mutex_unlock( &stagedLock);
+    
+    return count;
+}
+
+//the whole curve in one write
+static ssize_t curve_write( struct file *file, struct kobject *kobj, struct bin_attribute *attr,
+                            char *buf, loff_t off, size_t count)
+{
+    u16 *curve = (u16 *)buf;
+    
+    if ( off != 0 || count != sizeof( core.powerCurve))
+        return -EINVAL;
+    
+    if ( power_curve_check( curve))
+        return -EINVAL;
+    
+    mutex_lock( &stagedLock);
+    set_power_curve( &core, curve);
+    ktriac_core_publish( &core);
+    mutex_unlock( &stagedLock);
+    
+    return count;
+}
+
+static struct bin_attribute curve_attribute = {
+    .attr = { .name = "curve", .mode = 0664 },
+    .size = sizeof( core.powerCurve),
+    .read = curve_read,
+    .write = curve_write,
+};
+
+/*
+ * /sys/ktriac/speed: the speed control, see ktriac_uapi.h
+ */
+static void speed_status( struct ktriac_speed_status *status)
+{
+    unsigned long flags;
+    
+    mutex_lock( &stagedLock);
+    status->config = core.staged.speed.config;
+    mutex_unlock( &stagedLock);
+    
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+    status->rpm = core.speed.rpm;
+    status->error = core.speed.error;
+    status->integral = core.speed.integral >> 16;
+    status->output = core.speed.output;
+    status->pulses = core.speed.pulses;
+    status->glitches = core.speed.glitches;
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+}
+
+static ssize_t speed_show( struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct ktriac_speed_status status;
+    
+    speed_status( &status);
+    
+    return sprintf( buf, "Channel: %d\nTarget: %u rpm\nSpeed: %u rpm\nError: %d rpm\n"
+                         "Output: %u.%u%%\nIntegral: %s%d.%d%%\nKp: %d Ki: %d Kd: %d\nMin: %u Max: %u\nIntegral max: %u\n"
+                         "Pulses per rev: %u\nPulses: %u\nGlitches: %u\n",
+                    status.config.channel, status.config.target_rpm, status.rpm, status.error,
+                    status.output / 10, status.output % 10, ( status.integral < 0) ? "-" : "", abs( status.integral) / 10, abs( status.integral) % 10,
+                    status.config.kp, status.config.ki, status.config.kd, status.config.out_min, status.config.out_max,
+                    status.config.integral_max,
+                    status.config.pulses_per_rev, status.pulses, status.glitches);
+}
+
+static int speed_commit( const struct ktriac_speed *speed)
+{
+    int ret;
+    
+    ret = speed_check( &core, speed);
+    if ( ret)
+        return ret;
+    
+    mutex_lock( &stagedLock);
+    set_speed( &core.staged, speed);
+    ktriac_core_publish( &core);
+    mutex_unlock( &stagedLock);
+    
+    return 0;
+}
+
+//one "name value" at a time: channel, target, kp, ki, kd, min, max, imax, ppr
+static ssize_t speed_store( struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    struct ktriac_speed speed;
+    char name[ 16];
+    int value, ret;
+    
+    if ( sscanf( buf, "%15s %d", name, &value) != 2)
+        return -EINVAL;
+    
+    mutex_lock( &stagedLock);
+    speed = core.staged.speed.config;
+    mutex_unlock( &stagedLock);
+    
+    if ( strcmp( name, "channel") == 0)
+        speed.channel = value;
+    else
+    if ( strcmp( name, "target") == 0 && value >= 0)
+        speed.target_rpm = value;
+    else
+    if ( strcmp( name, "kp") == 0)
+        speed.kp = value;
+    else
+    if ( strcmp( name, "ki") == 0)
+        speed.ki = value;
+    else
+    if ( strcmp( name, "kd") == 0)
+        speed.kd = value;
+    else
+    if ( strcmp( name, "min") == 0 && value >= 0)
+        speed.out_min = value;
+    else
+    if ( strcmp( name, "max") == 0 && value >= 0)
+        speed.out_max = value;
+    else
+    if ( strcmp( name, "imax") == 0 && value >= 0)
+        speed.integral_max = value;
+    else
+    if ( strcmp( name, "ppr") == 0 && value >= 0)
+        speed.pulses_per_rev = value;
+    else
+        return -EINVAL;
+    
+    ret = speed_commit( &speed);
+    
+    return ( ret) ? ret : count;
+}
+
+static struct kobj_attribute speed_attribute = __ATTR( speed, 0664, speed_show, speed_store);
+
+static const char *calib_states[] = { "off", "latency", "fire time", "done", "failed" };
+
+static ssize_t calibrate_show( struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct calibration cal;
+    unsigned long flags;
+    int count = 0;
+
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+    cal = core.calib;
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+
+    count += sprintf( buf + count, "State: %s\nChannel: %u\nSense GPIO: %d\nSense edges: %u\n",
+                      calib_states[ cal.state], cal.channel, sense_gpio, cal.senseEdges);
+
+    if ( cal.state == CALIB_LATENCY || cal.state == CALIB_FIRE)
+        count += sprintf( buf + count, "Half phases: %u/%u conducted: %u\nGate pulse: %lld us\n",
+                          cal.count, KTRIAC_CALIB_HALF_PHASES, cal.good, div_s64( cal.fireTime, 1000));
+
+    if ( cal.state == CALIB_FIRE || cal.state == CALIB_DONE)
+        count += sprintf( buf + count, "Latency: %d us\n", cal.latency);
+
+    if ( cal.state == CALIB_DONE)
+        count += sprintf( buf + count, "Fire time: %lld us\n", div_s64( cal.fireResult, 1000));
+
+    return count;
+}
+
+//the channel to calibrate, -1 stops it
+static ssize_t calibrate_store( struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    int channel;
+
+    if ( sense_irq < 0)
+        return -ENODEV;
+
+    if ( kstrtoint( buf, 10, &channel) || channel >= (int)core.channelCount)
+        return -EINVAL;
+
+    mutex_lock( &stagedLock);
+    set_calibration( &core.staged, channel);
+    ktriac_core_publish( &core);
+    mutex_unlock( &stagedLock);
+
+    return count;
+}
+
+static struct kobj_attribute calibrate_attribute = __ATTR( calibrate, 0664, calibrate_show, calibrate_store);
+
+/*
+ * Delivered energy of a channel, zeroes the counters with KTRIAC_ENERGY_RESET
+ */
+static int energy_status( struct ktriac_energy *energy)
+{
+    struct triac_channel *ch;
+    unsigned long flags;
+
+    if ( energy->channel >= core.channelCount)
+        return -EINVAL;
+
+    ch = &core.channels[ energy->channel];
+
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+    energy->energy_ns = ch->energy;
+    energy->time_ns = ch->energyTime;
+    energy->half_phases = ch->halfPhases;
+    energy->conducted = ch->conducted;
+    if ( energy->flags & KTRIAC_ENERGY_RESET)
+        ch->energy = ch->energyTime = ch->halfPhases = ch->conducted = 0;
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+
+    energy->power_ppm = energy_ppm( energy->energy_ns, energy->time_ns);
+    energy->rms = int_sqrt( energy->power_ppm);
+
+    return 0;
+}
+
+static ssize_t energy_show( struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct ktriac_energy energy;
+    int count = 0;
+    unsigned int i;
+
+    for ( i = 0; i < core.channelCount; ++i)
+    {
+        energy.channel = i;
+        energy.flags = 0;
+        energy_status( &energy);
+
+        count += sprintf( buf + count, "Channel %u: energy: %llu ns time: %llu ns power: %u.%04u%% rms: %u.%u%% half phases: %llu conducted: %llu\n",
+                          i, energy.energy_ns, energy.time_ns, energy.power_ppm / 10000, energy.power_ppm % 10000,
+                          energy.rms / 10, energy.rms % 10, energy.half_phases, energy.conducted);
+    }
+
+    return count;
+}
+
+//the channel to zero the counters of
+static ssize_t energy_store( struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    struct ktriac_energy energy;
+
+    if ( kstrtouint( buf, 10, &energy.channel))
+        return -EINVAL;
+
+    energy.flags = KTRIAC_ENERGY_RESET;
+    if ( energy_status( &energy))
+        return -EINVAL;
+
+    return count;
+}
+
+static struct kobj_attribute energy_attribute = __ATTR( energy, 0664, energy_show, energy_store);
+
+/*
+ * State of the load group, zeroes the peak and the average with KTRIAC_GROUP_RESET
+ */
+static void group_status( struct ktriac_group_status *status)
+{
+    unsigned long flags;
+    u64 energy;
+
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+    status->members = core.settings->groupMembers;
+    status->rated_w = core.settings->groupRated;
+    status->demand_w = core.settings->groupDemand;
+    status->limit_w = core.groupLimit;
+    status->peak_w = core.groupPeak;
+    status->half_phases = core.groupHalfPhases;
+    energy = core.groupEnergy;
+    if ( status->flags & KTRIAC_GROUP_RESET)
+    {
+        core.groupPeak = 0;
+        core.groupEnergy = core.groupHalfPhases = 0;
+    }
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+
+    status->average_w = ( status->half_phases) ? div64_u64( energy, status->half_phases) : 0;
+}
+
+static ssize_t group_show( struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct ktriac_group_status status;
+
+    status.flags = 0;
+    group_status( &status);
+
+    return sprintf( buf, "Members: %u\nRated: %u W\nDemand: %u W\nLimit: %u W\nPeak: %u W\nAverage: %u W\nHalf phases: %llu\n",
+                    status.members, status.rated_w, status.demand_w, status.limit_w, status.peak_w, status.average_w, status.half_phases);
+}
+
+//anything zeroes the peak and the average
+static ssize_t group_store( struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    struct ktriac_group_status status;
+
+    status.flags = KTRIAC_GROUP_RESET;
+    group_status( &status);
+
+    return count;
+}
+
+static struct kobj_attribute group_attribute = __ATTR( group, 0664, group_show, group_store);
+
+static struct kobject *ktriac_kobject;
+
+static void triac_sysfs_init(void){
+    unsigned int i;
+//    printk(KERN_INFO "ktriac: starting sysfs...\n");
+    
+    ktriac_kobject = kobject_create_and_add("ktriac", NULL);
+    
+    for ( i = 0; i < core.channelCount; ++i)
+    {
+        struct kobj_attribute *attr = &channel_attributes[ i];
+        
+        if ( i)
+            snprintf( channel_attribute_names[ i], sizeof( channel_attribute_names[ i]), "ktriac%u", i);
+        else
+            snprintf( channel_attribute_names[ i], sizeof( channel_attribute_names[ i]), "ktriac");
+        
+        sysfs_attr_init( &attr->attr);
+        attr->attr.name = channel_attribute_names[ i];
+        attr->attr.mode = 0664;
+        attr->show = triac_show;
+        attr->store = triac_store;
+        
+        if (sysfs_create_file(ktriac_kobject, &attr->attr)) {
+            pr_debug("ktirac: failed to create triac sysfs!\n");
+        }
+    }
+    
+    if (sysfs_create_bin_file(ktriac_kobject, &curve_attribute)) {
+        pr_debug("ktirac: failed to create curve sysfs!\n");
+    }
+    
+    if (sysfs_create_file(ktriac_kobject, &speed_attribute.attr)) {
+        pr_debug("ktirac: failed to create speed sysfs!\n");
+    }
+
+    if (sysfs_create_file(ktriac_kobject, &calibrate_attribute.attr)) {
+        pr_debug("ktirac: failed to create calibrate sysfs!\n");
+    }
+
+    if (sysfs_create_file(ktriac_kobject, &energy_attribute.attr)) {
+        pr_debug("ktirac: failed to create energy sysfs!\n");
+    }
+
+    if (sysfs_create_file(ktriac_kobject, &group_attribute.attr)) {
+        pr_debug("ktirac: failed to create group sysfs!\n");
+    }
+}
+
+static void triac_sysfs_exit(void){
+    kobject_put(ktriac_kobject);
+}
+
+
+// DEBUGFS
+
+static struct dentry *ktriac_debugfs;
+
+//the file of the zerocross histograms, the channels have their index
+#define HIST_ZEROCROSS                  KTRIAC_MAX_CHANNELS
+
+static void hist_show( struct seq_file *m, const char *name, struct ktriac_hist *hist)
+{
+    unsigned int i;
+    
+    seq_printf( m, "%s:\n", name);
+    
+    for ( i = 0; i < KTRIAC_HIST_BUCKETS; ++i)
+    {
+        unsigned int count = READ_ONCE( hist->count[ i]);
+        
+        if ( count)
+            seq_printf( m, "%12llu - %12llu ns: %u\n", ( i) ? 1ULL << ( i - 1) : 0ULL, ( i) ? ( 1ULL << i) - 1 : 0ULL, count);
+    }
+}
+
+static int hist_file_show( struct seq_file *m, void *v)
+{
+    unsigned long index = (unsigned long)m->private;
+    
+    if ( index == HIST_ZEROCROSS)
+    {
+        hist_show( m, "Accepted zerocross period", &core.histPeriod);
+        hist_show( m, "Rejected edge since the last accepted", &core.histReject);
+        if ( dual_edge)
+            hist_show( m, "Zerocross pulse width", &core.histWidth);
+    }
+    else
+    {
+        hist_show( m, "Timer lateness", &core.channels[ index].histLate);
+        hist_show( m, "Edge to fire", &core.channels[ index].histFire);
+    }
+    
+    return 0;
+}
+
+static int hist_open( struct inode *inode, struct file *file)
+{
+    return single_open( file, hist_file_show, inode->i_private);
+}
+
+//any write resets the histograms of the file
+static ssize_t hist_write( struct file *file, const char __user *buf,
+                size_t count, loff_t *pos)
+{
+    struct seq_file *m = file->private_data;
+    unsigned long index = (unsigned long)m->private;
+    
+    if ( index == HIST_ZEROCROSS)
+    {
+        hist_reset( &core.histPeriod);
+        hist_reset( &core.histReject);
+        hist_reset( &core.histWidth);
+    }
+    else
+    {
+        hist_reset( &core.channels[ index].histLate);
+        hist_reset( &core.channels[ index].histFire);
+    }
+    
+    return count;
+}
+
+static const struct file_operations hist_fops = {
+    .owner = THIS_MODULE,
+    .open = hist_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .write = hist_write,
+    .release = single_release,
+};
+
+static void triac_debugfs_init( void)
+{
+    char name[ 16];
+    unsigned long i;
+    
+    ktriac_debugfs = debugfs_create_dir( "ktriac", NULL);
+    debugfs_create_file( "zerocross", 0644, ktriac_debugfs, (void *)HIST_ZEROCROSS, &hist_fops);
+    
+    for ( i = 0; i < core.channelCount; ++i)
+    {
+        snprintf( name, sizeof( name), "channel%lu", i);
+        debugfs_create_file( name, 0644, ktriac_debugfs, (void *)i, &hist_fops);
+    }
+}
+
+static void triac_debugfs_exit( void)
+{
+    debugfs_remove_recursive( ktriac_debugfs);
+}
+
+
+// CHARACTER DEVICE
+
+
+/*
+ * Check every command first, then stage all of them under one lock:
+ * the irq takes them over together at the next zerocross.
+ */
+static int config_commit( const struct ktriac_config *configs, unsigned int count)
+{
+    unsigned int i;
+    int ret;
+
+    for ( i = 0; i < count; ++i)
+    {
+        ret = config_check( &core, &configs[ i]);
+        if ( ret)
+            return ret;
+    }
+
+    mutex_lock( &stagedLock);
+
+    for ( i = 0; i < count; ++i)
+        config_apply( &core.staged, &configs[ i]);
+
+    ktriac_core_publish( &core);
+    mutex_unlock( &stagedLock);
+
+    return 0;
+}
+
+/*
+ * Read back the staged settings of config->channel
+ */
+static int config_get( struct ktriac_config *config)
+{
+    struct triac_setting *set;
+
+    if ( config->channel >= core.channelCount)
+        return -EINVAL;
+
+    mutex_lock( &stagedLock);
+
+    set = &core.staged.channel[ config->channel];
+    if ( set->burst)
+    {
+        config->set = KTRIAC_SET_BURST;
+        config->value = ( set->fullCycle) ? KTRIAC_BURST_FULL_CYCLE : 0;
+        config->mark = set->burstNum;
+        config->space = set->burstDen - set->burstNum;
+    }
+    else
+    {
+        config->set = ( set->mark) ? KTRIAC_SET_PWM : ( set->power >= 0) ? KTRIAC_SET_POWER : KTRIAC_SET_ANGLE;
+        config->value = ( set->power >= 0) ? set->power : set->angle;
+        config->mark = set->mark;
+        config->space = set->space;
+    }
+    config->fire_time_us = ktime_to_us( set->fireTime);
+    //< 0: from the end of the half phase, like it was set
+    config->latency_us = ( core.staged.latencyFromEnd) ? core.staged.zeroCrossLatency - core.staged.halfPhase
+                                                       : core.staged.zeroCrossLatency;
+    config->tolerance = core.staged.tolerance;
+    config->frequency = ( core.staged.freqAuto) ? 0 : core.staged.ac_freq;
+    config->phase = set->phase;
+
+    mutex_unlock( &stagedLock);
+
+    return 0;
+}
+
+/*
+ * Stage a ramp given by struct ktriac_ramp
+ */
+static int config_ramp( void __user *argp)
+{
+    struct ktriac_ramp *ramp;
+    int ret;
+    
+    ramp = memdup_user( argp, sizeof( *ramp));
+    if ( IS_ERR( ramp))
+        return PTR_ERR( ramp);
+    
+    ret = ramp_check( ramp->segment, ramp->count);
+    if ( !ret && ( ramp->channel >= core.channelCount || ramp->actual > 100 || ramp->actual < KTRIAC_RAMP_CURRENT))
+        ret = -EINVAL;
+    
+    if ( !ret)
+    {
+        mutex_lock( &stagedLock);
+        set_triac_ramp( &core, &core.staged, ramp->channel, ramp->segment, ramp->count, ramp->actual);
+        ktriac_core_publish( &core);
+        mutex_unlock( &stagedLock);
+    }
+    
+    kfree( ramp);
+    return ret;
+}
+
+/*
+ * State of the waveform playback of status->channel
+ */
+static int wave_status( struct ktriac_wave_status *status)
+{
+    struct wave_player *wave;
+    unsigned long flags;
+    
+    if ( status->channel >= core.channelCount)
+        return -EINVAL;
+    
+    wave = &core.wave[ status->channel];
+    
+    raw_spin_lock_irqsave( &scheduleLock, flags);
+    status->playing = wave->active;
+    status->free = ( wave->buffer[ 0].state == WAVE_FREE) + ( wave->buffer[ 1].state == WAVE_FREE);
+    status->underruns = wave->underruns;
+    status->played = wave->played;
+    raw_spin_unlock_irqrestore( &scheduleLock, flags);
+    
+    return 0;
+}
+
+static long dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+        void __user *argp = (void __user *)arg;
+        struct ktriac_wave_status status;
+        struct ktriac_speed_status speedStatus;
+        struct ktriac_energy energy;
+        struct ktriac_group_status group;
+        struct ktriac_load load;
+        struct ktriac_speed speed;
+        struct ktriac_config config;
+        struct ktriac_batch batch;
+        struct ktriac_config *configs;
+        int ret;
+
+        switch ( cmd) {
+            case KTRIAC_IOC_SET:
+                if ( !( file->f_mode & FMODE_WRITE))
+                    return -EBADF;
+
+                if ( copy_from_user( &config, argp, sizeof( config)))
+                    return -EFAULT;
+
+                return config_commit( &config, 1);
+
+            case KTRIAC_IOC_SET_BATCH:
+                if ( !( file->f_mode & FMODE_WRITE))
+                    return -EBADF;
+
+                if ( copy_from_user( &batch, argp, sizeof( batch)))
+                    return -EFAULT;
+
+                if ( batch.count == 0 || batch.count > KTRIAC_MAX_BATCH)
+                    return -EINVAL;
+
+                configs = memdup_user( u64_to_user_ptr( batch.configs), batch.count * sizeof( struct ktriac_config));
+                if ( IS_ERR( configs))
+                    return PTR_ERR( configs);
+
+                ret = config_commit( configs, batch.count);
+                kfree( configs);
+
+                return ret;
+
+            case KTRIAC_IOC_RAMP:
+                if ( !( file->f_mode & FMODE_WRITE))
+                    return -EBADF;
+                
+                return config_ramp( argp);
+            
+            case KTRIAC_IOC_GET:
+                if ( copy_from_user( &config, argp, sizeof( config)))
+                    return -EFAULT;
+
+                ret = config_get( &config);
+                if ( ret)
+                    return ret;
+
+                if ( copy_to_user( argp, &config, sizeof( config)))
+                    return -EFAULT;
+
+                return 0;
+
+            case KTRIAC_IOC_SPEED:
+                if ( !( file->f_mode & FMODE_WRITE))
+                    return -EBADF;
+
+                if ( copy_from_user( &speed, argp, sizeof( speed)))
+                    return -EFAULT;
+
+                return speed_commit( &speed);
+
+            case KTRIAC_IOC_SPEED_STATUS:
+                speed_status( &speedStatus);
+
+                if ( copy_to_user( argp, &speedStatus, sizeof( speedStatus)))
+                    return -EFAULT;
+
+                return 0;
+
+            case KTRIAC_IOC_ENERGY:
+                if ( copy_from_user( &energy, argp, sizeof( energy)))
+                    return -EFAULT;
+
+                if ( ( energy.flags & KTRIAC_ENERGY_RESET) && !( file->f_mode & FMODE_WRITE))
+                    return -EBADF;
+
+                ret = energy_status( &energy);
+                if ( ret)
+                    return ret;
+
+                if ( copy_to_user( argp, &energy, sizeof( energy)))
+                    return -EFAULT;
+
+                return 0;
+
+            case KTRIAC_IOC_LOAD:
+                if ( !( file->f_mode & FMODE_WRITE))
+                    return -EBADF;
+
+                if ( copy_from_user( &load, argp, sizeof( load)))
+                    return -EFAULT;
+
+                return load_commit( &load);
+
+            case KTRIAC_IOC_GROUP_STATUS:
+                if ( copy_from_user( &group, argp, sizeof( group)))
+                    return -EFAULT;
+
+                if ( ( group.flags & KTRIAC_GROUP_RESET) && !( file->f_mode & FMODE_WRITE))
+                    return -EBADF;
+
+                group_status( &group);
+
+                if ( copy_to_user( argp, &group, sizeof( group)))
+                    return -EFAULT;
+
+                return 0;
+
+            case KTRIAC_IOC_WAVE_STATUS:
+                if ( copy_from_user( &status, argp, sizeof( status)))
+                    return -EFAULT;
+
+                ret = wave_status( &status);
+                if ( ret)
+                    return ret;
+
+                if ( copy_to_user( argp, &status, sizeof( status)))
+                    return -EFAULT;
+
+                return 0;
+        }
+
+        return -ENOTTY;
+}
+
+/*
+ * A read only mapping stays read only: without VM_MAYWRITE mprotect() can not
+ * make it writable in a file opened for writing
+ */
+static void vma_read_only( struct vm_area_struct *vma)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 6, 3, 0)
+    vm_flags_clear( vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+}
+
+#ifdef DEBUG_DEVICE
+
+/*
+ * Every open file reads the event ring on its own
+ */
+struct ring_reader {
+    unsigned int tail;
+    unsigned int dropped;
+};
+
+static int dev_open(struct inode *inode, struct file *file)
+{
+        struct ring_reader *reader = kzalloc( sizeof( *reader), GFP_KERNEL);
+
+        if ( !reader)
+            return -ENOMEM;
+
+        reader->tail = smp_load_acquire( &ringHead);
+        file->private_data = reader;
+
+        return nonseekable_open(inode, file);
+}
+
+static int dev_release(struct inode *inode, struct file *file)
+{
+        kfree( file->private_data);
+        return 0;
+}
+
+static ssize_t dev_read(struct file *file, char __user *buf,
+                size_t count, loff_t *pos)
+{
+        struct ring_reader *reader = file->private_data;
+        struct ktriac_event tmp[16];
+        size_t len = 0;
+
+        if ( count < sizeof( struct ktriac_event))
+            return -EINVAL;
+
+        if ( file->f_flags & O_NONBLOCK)
+        {
+            if ( smp_load_acquire( &ringHead) == reader->tail)
+                return -EAGAIN;
+        }
+        else
+        if ( wait_event_interruptible(waitqueue, smp_load_acquire( &ringHead) != reader->tail))
+            return -ERESTARTSYS;
+
+        while ( count - len >= sizeof( struct ktriac_event))
+        {
+            unsigned int head = smp_load_acquire( &ringHead);
+            unsigned int n, skip, i;
+            
+            //fell behind: jump to the oldest record the irq is not overwriting
+            if ( head - reader->tail >= KTRIAC_RING_SIZE)
+            {
+                reader->dropped += head - KTRIAC_RING_SIZE + 1 - reader->tail;
+                reader->tail = head - KTRIAC_RING_SIZE + 1;
+            }
+            
+            if ( reader->dropped)
+            {
+                memset( &tmp[0], 0, sizeof( tmp[0]));
+                tmp[0].timestamp = ktime_to_ns( ktime_get());
+                tmp[0].type = KTRIAC_EVENT_DROPPED;
+                tmp[0].data = reader->dropped;
+                
+                if ( copy_to_user( buf + len, &tmp[0], sizeof( tmp[0])))
+                    return -EFAULT;
+                
+                len += sizeof( tmp[0]);
+                reader->dropped = 0;
+                continue;
+            }
+            
+            n = min3( head - reader->tail, (unsigned int)ARRAY_SIZE( tmp), (unsigned int)(( count - len) / sizeof( struct ktriac_event)));
+            if ( !n)
+                break;
+            
+            for ( i = 0; i < n; ++i)
+                tmp[ i] = ringEvents[ ( reader->tail + i) & ( KTRIAC_RING_SIZE - 1)];
+            
+            //the irq may have overwritten the oldest records while we copied them
+            smp_rmb();
+            head = READ_ONCE( ringHead);
+            skip = ( head - reader->tail >= KTRIAC_RING_SIZE) ? min( head - KTRIAC_RING_SIZE + 1 - reader->tail, n) : 0;
+            
+            reader->dropped += skip;
+            reader->tail += n;
+            
+            if ( copy_to_user( buf + len, &tmp[ skip], ( n - skip) * sizeof( struct ktriac_event)))
+                return -EFAULT;
+            
+            len += ( n - skip) * sizeof( struct ktriac_event);
+        }
+
+        return len;
+}
+
+unsigned int dev_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    struct ring_reader *reader = filp->private_data;
+    
+    poll_wait(filp, &waitqueue, wait);
+    
+    if ( smp_load_acquire( &ringHead) != reader->tail)
+        return POLLIN | POLLRDNORM;
+    
+    return 0;
+}
+
+/*
+ * The ring can be mapped read only, see ktriac_uapi.h
+ */
+static int ring_mmap( struct vm_area_struct *vma)
+{
+    if ( vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    
+    vma_read_only( vma);
+    return remap_vmalloc_range( vma, ring, vma->vm_pgoff);
+}
+
+#else
+
+static int dev_open(struct inode *inode, struct file *file)
+{
+        return nonseekable_open(inode, file);
+}
+
+static int dev_release(struct inode *inode, struct file *file)
+{
+        return 0;
+}
+
+#endif
+
+/*
+ * Queue a waveform buffer of a channel: struct ktriac_wave_header and the entries
+ */
+static ssize_t dev_write(struct file *file, const char __user *buf,
+                size_t count, loff_t *pos)
+{
+        struct ktriac_wave_header header;
+        struct wave_buffer *wave;
+        unsigned long flags;
+        size_t size;
+        ssize_t ret;
+
+        if ( count < sizeof( header))
+            return -EINVAL;
+
+        if ( copy_from_user( &header, buf, sizeof( header)))
+            return -EFAULT;
+
+        if ( header.channel >= core.channelCount || header.count > KTRIAC_WAVE_SIZE ||
+             ( header.flags & ~( KTRIAC_WAVE_LOOP | KTRIAC_WAVE_LAST)))
+            return -EINVAL;
+
+        size = sizeof( header) + header.count * sizeof( struct ktriac_wave_entry);
+        if ( count < size)
+            return -EINVAL;
+
+        if ( mutex_lock_interruptible( &waveMutex))
+            return -ERESTARTSYS;
+
+        if ( header.count == 0)
+        {
+            raw_spin_lock_irqsave( &scheduleLock, flags);
+            wave_stop( &core, header.channel);
+            raw_spin_unlock_irqrestore( &scheduleLock, flags);
+
+            wake_up( &waveQueue);
+            ret = size;
+            goto out;
+        }
+
+        //both buffers are queued: wait for the irq to finish one
+        while ( !( wave = wave_buffer( &core, header.channel)))
+        {
+            mutex_unlock( &waveMutex);
+
+            if ( file->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+
+            if ( wait_event_interruptible( waveQueue, wave_buffer( &core, header.channel)))
+                return -ERESTARTSYS;
+
+            if ( mutex_lock_interruptible( &waveMutex))
+                return -ERESTARTSYS;
+        }
+
+        //the irq does not touch a free buffer
+        if ( copy_from_user( wave->entry, buf + sizeof( header), header.count * sizeof( struct ktriac_wave_entry)))
+        {
+            ret = -EFAULT;
+            goto out;
+        }
+
+        ret = wave_check( wave->entry, header.count);
+        if ( !ret)
+        {
+            wave_queue( &core, header.channel, header.count, header.flags);
+            ret = size;
+        }
+
+out:
+        mutex_unlock( &waveMutex);
+        return ret;
+}
+
+/*
+ * The control page from KTRIAC_CONTROL_OFFSET: the status read only, the setpoints
+ * writable (a shared writable mapping needs a file open for writing), see ktriac_uapi.h.
+ * Below it the event ring.
+ */
+static int dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    unsigned long page;
+
+    if ( vma->vm_pgoff < ( KTRIAC_CONTROL_OFFSET >> PAGE_SHIFT))
+#ifdef DEBUG_DEVICE
+        return ring_mmap( vma);
+#else
+        return -EINVAL;
+#endif
+
+    page = vma->vm_pgoff - ( KTRIAC_CONTROL_OFFSET >> PAGE_SHIFT);
+    if ( page == 0)
+    {
+        if ( vma->vm_flags & VM_WRITE)
+            return -EPERM;
+
+        vma_read_only( vma);
+    }
+
+    return remap_vmalloc_range( vma, control, page);
+}
+
+static struct file_operations dev_fops = {
+    .owner = THIS_MODULE,
+    .open = dev_open,
+    .write = dev_write,
+    .unlocked_ioctl = dev_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+#ifdef DEBUG_DEVICE
+    .read = dev_read,
+    .poll = dev_poll,
+#endif
+    .mmap = dev_mmap,
+    .release = dev_release,
+};
+
+static struct miscdevice dev_misc_device = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "ktriac",
+    .fops = &dev_fops,
+    //it switches the loads: root and its group only, like the sysfs control
+    .mode = 0660
+};
+
+
+/*
+ * The tachometer input and its irq
+ */
+static int tacho_init( void)
+{
+    int ret;
+    
+    ret = gpio_request_one( tacho_gpio, GPIOF_IN, "Tacho");
+    if ( ret)
+    {
+        printk(KERN_ERR "ktriac - Unable to request the tacho GPIO %d: %d\n", tacho_gpio, ret);
+        return ret;
+    }
+    
+    ret = gpio_to_irq( tacho_gpio);
+    if ( ret >= 0)
+    {
+        tacho_irq = ret;
+        ret = request_irq( tacho_irq, tacho_isr, IRQF_TRIGGER_RISING | IRQF_NO_THREAD, "ktriac_tacho", NULL);
+    }
+    
+    if ( ret)
+    {
+        printk(KERN_ERR "ktriac - Unable to request the tacho IRQ: %d\n", ret);
+        tacho_irq = -1;
+        gpio_free( tacho_gpio);
+        return ret;
+    }
+    
+    if ( cpu >= 0)
+        irq_set_affinity_hint( tacho_irq, cpumask_of( cpu));
+    
+    return 0;
+}
+
+static void tacho_exit( void)
+{
+    if ( tacho_irq < 0)
+        return;
+    
+    if ( cpu >= 0)
+        irq_set_affinity_hint( tacho_irq, NULL);
+    free_irq( tacho_irq, NULL);
+    gpio_free( tacho_gpio);
+}
+
+/*
+ * The load current sense input and its irq
+ */
+static int sense_init( void)
+{
+    int ret;
+
+    ret = gpio_request_one( sense_gpio, GPIOF_IN, "Sense");
+    if ( ret)
+    {
+        printk(KERN_ERR "ktriac - Unable to request the sense GPIO %d: %d\n", sense_gpio, ret);
+        return ret;
+    }
+
+    ret = gpio_to_irq( sense_gpio);
+    if ( ret >= 0)
+    {
+        sense_irq = ret;
+        ret = request_irq( sense_irq, sense_isr, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING | IRQF_NO_THREAD, "ktriac_sense", NULL);
+    }
+
+    if ( ret)
+    {
+        printk(KERN_ERR "ktriac - Unable to request the sense IRQ: %d\n", ret);
+        sense_irq = -1;
+        gpio_free( sense_gpio);
+        return ret;
+    }
+
+    if ( cpu >= 0)
+        irq_set_affinity_hint( sense_irq, cpumask_of( cpu));
+
+    return 0;
+}
+
+static void sense_exit( void)
+{
+    if ( sense_irq < 0)
+        return;
+
+    if ( cpu >= 0)
+        irq_set_affinity_hint( sense_irq, NULL);
+    free_irq( sense_irq, NULL);
+    gpio_free( sense_gpio);
+}
+
+/*
+ * The zerocross inputs of L2 and L3 and their irqs, rising edges like the zerocross input
+ */
+static int phase_init( void)
+{
+    int ret = 0;
+    unsigned int i;
+
+    for ( i = 0; i < KTRIAC_PHASES - 1; ++i)
+    {
+        ret = gpio_request_one( phase_gpios[ i], GPIOF_IN, ( i) ? "AC Signal L3" : "AC Signal L2");
+        if ( ret)
+        {
+            printk(KERN_ERR "ktriac - Unable to request the GPIO %d of L%u: %d\n", phase_gpios[ i], i + 2, ret);
+            break;
+        }
+
+        ret = gpio_to_irq( phase_gpios[ i]);
+        if ( ret >= 0)
+        {
+            phase_irqs[ i] = ret;
+            ret = request_irq( phase_irqs[ i], phase_isr, IRQF_TRIGGER_RISING | IRQF_NO_THREAD,
+                               ( i) ? "ktriac_ac_zerocross_l3" : "ktriac_ac_zerocross_l2", &phase_irqs[ i]);
+        }
+
+        if ( ret)
+        {
+            printk(KERN_ERR "ktriac - Unable to request the IRQ of L%u: %d\n", i + 2, ret);
+            phase_irqs[ i] = -1;
+            gpio_free( phase_gpios[ i]);
+            break;
+        }
+
+        if ( cpu >= 0)
+            irq_set_affinity_hint( phase_irqs[ i], cpumask_of( cpu));
+    }
+
+    if ( ret)
+    {
+        while ( i--)
+        {
+            if ( cpu >= 0)
+                irq_set_affinity_hint( phase_irqs[ i], NULL);
+            free_irq( phase_irqs[ i], &phase_irqs[ i]);
+            gpio_free( phase_gpios[ i]);
+            phase_irqs[ i] = -1;
+        }
+    }
+
+    return ret;
+}
+
+static void phase_exit( void)
+{
+    unsigned int i;
+
+    for ( i = 0; i < KTRIAC_PHASES - 1; ++i)
+    {
+        if ( phase_irqs[ i] < 0)
+            continue;
+
+        if ( cpu >= 0)
+            irq_set_affinity_hint( phase_irqs[ i], NULL);
+        free_irq( phase_irqs[ i], &phase_irqs[ i]);
+        gpio_free( phase_gpios[ i]);
+    }
+}
+
+/*
+ * Module init function
+ */
+static int __init ktriac_init(void)
+{
+        struct ktriac_config params = {
+            .set = KTRIAC_SET_LATENCY | KTRIAC_SET_FIRE_TIME,
+            .latency_us = zerocross_latency,
+            .fire_time_us = fire_time,
+        };
+        unsigned long trigger;
+        int ret = 0;
+        unsigned int i;
+//        printk(KERN_INFO "%s\n", __func__);
+
+        //without gpios parameter drive GPIO_TRIAC only
+        ktriac_core_init( &core, &hw, NULL, ( gpioCount) ? gpioCount : 1);
+
+        //calibrated values of an earlier run, if they are kept in the module options:
+        //checked like a KTRIAC_IOC_SET, a stale option must not stretch the gate pulse
+        if ( config_check( &core, &params))
+        {
+            printk(KERN_ERR "ktriac - zerocross_latency=%d or fire_time=%u is out of range (max -/+%d us, %d us)\n",
+                   zerocross_latency, fire_time, KTRIAC_LATENCY_MAX - 1, KTRIAC_FIRE_TIME_MAX);
+            return -EINVAL;
+        }
+
+        set_zerocross_latency( &core.staged, zerocross_latency);
+        for ( i = 0; i < core.channelCount; ++i)
+            core.staged.channel[ i].fireTime = (s64)fire_time * 1000;
+
+        //three phase: the channels go round the phases
+        for ( i = 0; i < core.channelCount && three_phase; ++i)
+            set_triac_phase( &core.staged, i, i % KTRIAC_PHASES);
+        ktriac_core_publish( &core);
+        
+        if ( cpu >= 0 && ( cpu >= nr_cpu_ids || !cpu_online( cpu)))
+        {
+            printk(KERN_ERR "ktriac - cpu %d is not online\n", cpu);
+            return -EINVAL;
+        }
+
+        if ( phaseGpioCount && ( !three_phase || phaseGpioCount != KTRIAC_PHASES - 1))
+        {
+            printk(KERN_ERR "ktriac - phase_gpios needs three_phase and the inputs of both L2 and L3\n");
+            return -EINVAL;
+        }
+
+        if ( phaseGpioCount)
+            ktriac_core_phase_inputs( &core);
+        
+        for ( i = 0; i < core.channelCount; ++i)
+        {
+            pins[ i + 1].gpio = gpios[ i];
+            pins[ i + 1].flags = GPIOF_OUT_INIT_LOW;
+            pins[ i + 1].label = "TRIAC trigger";
+        }
+        
+        BUILD_BUG_ON( sizeof( struct ktriac_control_status) > PAGE_SIZE ||
+                      KTRIAC_CONTROL_CHANNELS * sizeof( struct ktriac_setpoint) > PAGE_SIZE);
+
+        control = vmalloc_user( 2 * PAGE_SIZE);
+        if ( !control)
+            return -ENOMEM;
+
+        control->page_size = PAGE_SIZE;
+        ktriac_core_control( &core, control, (struct ktriac_setpoint *)( (char *)control + PAGE_SIZE));
+        
+#ifdef DEBUG_DEVICE        
+        // the irq fills the event ring from the beginning
+        init_waitqueue_head(&waitqueue);
+        ring = vmalloc_user( RING_BYTES);
+        if ( !ring)
+        {
+            vfree( control);
+            return -ENOMEM;
+        }
+        
+        ring->size = KTRIAC_RING_SIZE;
+        ring->event_size = sizeof( struct ktriac_event);
+        ring->offset = RING_EVENTS_OFFSET;
+        ringEvents = (struct ktriac_event *)( (char *)ring + RING_EVENTS_OFFSET);
+        ringHead = 0;
+#endif
+        init_irq_work( &deferWork, defer_run);
+        INIT_WORK( &reportWork, report_run);
+        
+        // register GPIO PIN in use
+        ret = gpio_request_array(pins, core.channelCount + 1);
+
+        if (ret) {
+                printk(KERN_ERR "ktriac - Unable to request GPIOs for zerocrossing signals & TRIAC output: %d\n", ret);
+                goto fail2;
+        }
+
+        // Register IRQ for this GPIO
+        ret = gpio_to_irq(pins[0].gpio);
+        if(ret < 0) {
+                printk(KERN_ERR "ktriac - Unable to request IRQ: %d\n", ret);
+                goto fail2;
+        }
+
+        ac_irqs[0] = ret;
+        
+        //init hrtimer, the irq starts it: on the cpu of the irq, pinned there if asked
+        if ( cpu >= 0)
+            timerMode = KTRIAC_HRTIMER_MODE | HRTIMER_MODE_PINNED;
+        
+        hrtimer_init(&hr_timer, CLOCK_MONOTONIC, KTRIAC_HRTIMER_MODE);
+        hr_timer.function = &triac_fire;
+        
+        printk(KERN_INFO "ktriac - Successfully requested zerocrossing IRQ # %d\n", ac_irqs[0]);
+        //the input goes low at the zerocross: the rising edge ends the pulse
+        trigger = ( dual_edge) ? IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING : IRQF_TRIGGER_RISING;
+        if ( threaded)
+            //IRQF_NO_THREAD: keep the timestamp in hard irq context on PREEMPT_RT too
+            ret = request_threaded_irq(ac_irqs[0], zerocross_stamp_isr, zerocross_thread_isr, trigger | IRQF_NO_THREAD, "ktriac_ac_zerocross#trigger", NULL);
+        else
+            ret = request_irq(ac_irqs[0], zerocross_trigger_isr, trigger, "ktriac_ac_zerocross#trigger", NULL);
+        if(ret) {
+                printk(KERN_ERR "ktriac - Unable to request IRQ: %d\n", ret);
+                goto fail3;
+        }
+        
+        //the irq thread follows the affinity of the irq
+        if ( cpu >= 0 && irq_set_affinity_hint( ac_irqs[0], cpumask_of( cpu)))
+                printk(KERN_INFO "ktriac: cannot move IRQ # %d to cpu %d\n", ac_irqs[0], cpu);
+        
+        if ( tacho_gpio >= 0)
+        {
+            ret = tacho_init();
+            if ( ret)
+                goto fail4;
+        }
+
+        if ( sense_gpio >= 0)
+        {
+            ret = sense_init();
+            if ( ret)
+            {
+                tacho_exit();
+                goto fail4;
+            }
+        }
+
+        if ( phaseGpioCount)
+        {
+            ret = phase_init();
+            if ( ret)
+            {
+                sense_exit();
+                tacho_exit();
+                goto fail4;
+            }
+        }
+
+        //set triac outputs to low
+        for ( i = 0; i < core.channelCount; ++i)
+            triac( &core, i, OFF);
+        
+        triac_sysfs_init();
+        triac_debugfs_init();
+        
+        // Register a character device for communication with user space
+        misc_register(&dev_misc_device);
+        
+        return 0;
+
+        // cleanup what has been setup so far
+fail4:
+        if ( cpu >= 0)
+            irq_set_affinity_hint(ac_irqs[0], NULL);
+        free_irq(ac_irqs[0], NULL);
+        hrtimer_cancel(&hr_timer);
+        irq_work_sync( &deferWork);
+        cancel_work_sync( &reportWork);
+        goto fail2;
+
+fail3:
+        free_irq(ac_irqs[0], NULL);
+
+fail2: 
+        gpio_free_array(pins, core.channelCount + 1);
+#ifdef DEBUG_DEVICE        
+        vfree( ring);
+#endif
+        vfree( control);
+        return ret;
+}
+
+/**
+ * Module exit function
+ */
+static void __exit ktriac_exit(void)
+{
+        unsigned int i;
+//        printk(KERN_INFO "%s\n", __func__);
+
+        // stop every irq before the timer, they would restart it,
+        // then the deferred work: the irqs and the timer queue it
+        if ( cpu >= 0)
+            irq_set_affinity_hint(ac_irqs[0], NULL);
+        free_irq(ac_irqs[0], NULL);
+        phase_exit();
+        sense_exit();
+        tacho_exit();
+        hrtimer_cancel(&hr_timer);
+        irq_work_sync( &deferWork);
+        cancel_work_sync( &reportWork);
+        
+        for ( i = 0; i < core.channelCount; ++i)
+            triac( &core, i, OFF);
+        
+        misc_deregister(&dev_misc_device);
+        triac_debugfs_exit();
+#ifdef DEBUG_DEVICE        
+        vfree( ring);
+#endif
+        vfree( control);
+        
+        triac_sysfs_exit();
+
+        // unregister
+        gpio_free_array(pins, core.channelCount + 1);
+}
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("The TunguZka Team Hungary");
+MODULE_DESCRIPTION("Linux Kernel Module for control TRIACs and so AC circuits");
+
+module_init(ktriac_init);
+module_exit(ktriac_exit);
@@ -0,0 +1,162 @@
+/*********************************************
+*** Linux kernel module to drive TRIAC with
+*** Raspberry Pi
+***
+*** Tracepoints of the timing core, for ftrace,
+*** perf and trace-cmd: events/ktriac/
+*** Times are CLOCK_MONOTONIC ns.
+***
+*** Written by The TunguZka Team Hungary
+*** GNU GPLv3 license
+*********************************************/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ktriac
+
+#if !defined( _KTRIAC_TRACE_H) || defined( TRACE_HEADER_MULTI_READ)
+#define _KTRIAC_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "ktriac_uapi.h"
+
+#define show_ktriac_reason( reason)                          \
+    __print_symbolic( reason,                                   \
+        { KTRIAC_REASON_NONE,           "none" },               \
+        { KTRIAC_REASON_GLITCH,         "glitch" },             \
+        { KTRIAC_REASON_EARLY,          "early" },              \
+        { KTRIAC_REASON_LATE,           "late" },               \
+        { KTRIAC_REASON_COAST,          "coast" },              \
+        { KTRIAC_REASON_WIDTH,          "width" })
+
+//accepted zerocross (or a coasted one): the half phase is planned from zc
+TRACE_EVENT( ktriac_zerocross,
+
+    TP_PROTO( s64 now, s64 zc, s64 delta_us, unsigned int reason),
+
+    TP_ARGS( now, zc, delta_us, reason),
+
+    TP_STRUCT__entry(
+        __field( s64, now)
+        __field( s64, zc)
+        __field( s64, delta_us)
+        __field( unsigned int, reason)
+    ),
+
+    TP_fast_assign(
+        __entry->now = now;
+        __entry->zc = zc;
+        __entry->delta_us = delta_us;
+        __entry->reason = reason;
+    ),
+
+    TP_printk( "now=%lld zc=%lld delta=%lldus reason=%s",
+        __entry->now, __entry->zc, __entry->delta_us, show_ktriac_reason( __entry->reason))
+);
+
+//edge of the zerocross input not accepted
+TRACE_EVENT( ktriac_reject,
+
+    TP_PROTO( s64 now, s64 delta_us, unsigned int reason),
+
+    TP_ARGS( now, delta_us, reason),
+
+    TP_STRUCT__entry(
+        __field( s64, now)
+        __field( s64, delta_us)
+        __field( unsigned int, reason)
+    ),
+
+    TP_fast_assign(
+        __entry->now = now;
+        __entry->delta_us = delta_us;
+        __entry->reason = reason;
+    ),
+
+    TP_printk( "now=%lld delta=%lldus reason=%s",
+        __entry->now, __entry->delta_us, show_ktriac_reason( __entry->reason))
+);
+
+//the timer is (re)armed to the next event of the schedule
+TRACE_EVENT( ktriac_arm,
+
+    TP_PROTO( s64 now, s64 expires),
+
+    TP_ARGS( now, expires),
+
+    TP_STRUCT__entry(
+        __field( s64, now)
+        __field( s64, expires)
+    ),
+
+    TP_fast_assign(
+        __entry->now = now;
+        __entry->expires = expires;
+    ),
+
+    TP_printk( "now=%lld expires=%lld in=%lldns",
+        __entry->now, __entry->expires, __entry->expires - __entry->now)
+);
+
+//gate of a channel switched at now, it was due at due
+TRACE_EVENT( ktriac_gate,
+
+    TP_PROTO( unsigned int channel, unsigned int on, s64 due, s64 now),
+
+    TP_ARGS( channel, on, due, now),
+
+    TP_STRUCT__entry(
+        __field( unsigned int, channel)
+        __field( unsigned int, on)
+        __field( s64, due)
+        __field( s64, now)
+    ),
+
+    TP_fast_assign(
+        __entry->channel = channel;
+        __entry->on = on;
+        __entry->due = due;
+        __entry->now = now;
+    ),
+
+    TP_printk( "channel=%u gate=%s due=%lld late=%lldns",
+        __entry->channel, __entry->on ? "on" : "off", __entry->due, __entry->now - __entry->due)
+);
+
+//new settings of a channel taken over at a zerocross, power -1: angle or pwm mode
+TRACE_EVENT( ktriac_config,
+
+    TP_PROTO( unsigned int channel, int angle, int power, unsigned int mark, unsigned int space, unsigned int duty),
+
+    TP_ARGS( channel, angle, power, mark, space, duty),
+
+    TP_STRUCT__entry(
+        __field( unsigned int, channel)
+        __field( int, angle)
+        __field( int, power)
+        __field( unsigned int, mark)
+        __field( unsigned int, space)
+        __field( unsigned int, duty)
+    ),
+
+    TP_fast_assign(
+        __entry->channel = channel;
+        __entry->angle = angle;
+        __entry->power = power;
+        __entry->mark = mark;
+        __entry->space = space;
+        __entry->duty = duty;
+    ),
+
+    TP_printk( "channel=%u angle=%d power=%d pwm=%u:%u duty=%u%%",
+        __entry->channel, __entry->angle, __entry->power, __entry->mark, __entry->space, __entry->duty)
+);
+
+#endif
+
+//outside of the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ktriac_trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,375 @@
+/*********************************************
+*** Linux kernel module to drive TRIAC with
+*** Raspberry Pi
+***
+*** Definitions shared with userspace:
+*** records of the /dev/ktriac event ring
+*** and the ioctl control interface
+***
+*** Written by The TunguZka Team Hungary
+*** GNU GPLv3 license
+*********************************************/
+
+#ifndef KTRIAC_UAPI_H
+#define KTRIAC_UAPI_H
+
+#include <linux/types.h>
+
+
+/***********************************
+ * EVENT RING
+ *
+ * read() on /dev/ktriac returns whole struct ktriac_event records,
+ * every open file has its own read position.
+ * The ring can be mmap()-ed read only as well: struct ktriac_ring_header
+ * followed by the records at header.offset, record i is at i & ( size - 1).
+ * A record is valid while head - i < size: copy it, then check head again.
+ * *********************************/
+
+//accepted zerocross, data: us since the last accepted one,
+//fire: the zerocross estimated by the PLL, the channels fire from it
+#define KTRIAC_EVENT_ZEROCROSS          1
+//not accepted zerocross irq, data: us since the last accepted one
+#define KTRIAC_EVENT_REJECT             2
+//gate pulse of a channel: fire & release are the real switching times
+#define KTRIAC_EVENT_GATE               3
+//channel settings changed, data: duty in %
+#define KTRIAC_EVENT_CONFIG             4
+//only on read(): the reader was too slow, data: number of lost events
+#define KTRIAC_EVENT_DROPPED            5
+//raw edge of the zerocross input before any filtering (capture module parameter),
+//timestamp: the irq, data: level of the input (1 without dual edge mode)
+#define KTRIAC_EVENT_EDGE               6
+
+//reasons
+#define KTRIAC_REASON_NONE              0
+//irq came less than 300us after the last zerocross
+#define KTRIAC_REASON_GLITCH            1
+//irq came before the tolerance range
+#define KTRIAC_REASON_EARLY             2
+//zerocross accepted but came after the tolerance range
+#define KTRIAC_REASON_LATE              3
+//no zerocross came, the PLL went on with the predicted one
+#define KTRIAC_REASON_COAST             4
+//dual edge mode: the zerocross pulse is much shorter or longer than the average, data: width in us
+#define KTRIAC_REASON_WIDTH             5
+
+struct ktriac_event {
+    __s64 timestamp;            //CLOCK_MONOTONIC ns of the zerocross irq
+    __s64 fire;                 //gate on, ns, 0 if not fired
+    __s64 release;              //gate off, ns
+    __u32 data;
+    __u16 type;
+    __u8 channel;
+    __u8 reason;
+};
+
+struct ktriac_ring_header {
+    __u32 head;                 //number of events written so far, wraps around
+    __u32 size;                 //number of records in the ring, power of 2
+    __u32 event_size;           //sizeof( struct ktriac_event)
+    __u32 offset;               //offset of the first record from the start of the mapping
+};
+
+
+/***********************************
+ * IOCTL
+ *
+ * KTRIAC_IOC_SET applies one struct ktriac_config, KTRIAC_IOC_SET_BATCH
+ * up to KTRIAC_MAX_BATCH of them. Every command of a call is checked
+ * first, then all of them take effect together at the next zerocross.
+ * *********************************/
+
+#define KTRIAC_IOC_MAGIC                'k'
+
+//fields of struct ktriac_config to apply
+//value: attack angle in deg, -1 or > 180 turns off
+#define KTRIAC_SET_ANGLE                ( 1 << 0)
+//value: power in % 0-100
+#define KTRIAC_SET_PERCENT              ( 1 << 1)
+//mark:space half phases
+#define KTRIAC_SET_PWM                  ( 1 << 2)
+//fire_time_us of the channel
+#define KTRIAC_SET_FIRE_TIME            ( 1 << 3)
+//latency_us of the zerocross detection, < 0: half phase + latency_us
+#define KTRIAC_SET_LATENCY              ( 1 << 4)
+//tolerance in %
+#define KTRIAC_SET_TOLERANCE            ( 1 << 5)
+//frequency in Hz (45..65), 0: detect 50 or 60Hz
+#define KTRIAC_SET_FREQUENCY            ( 1 << 6)
+//value: power in 1/KTRIAC_POWER_STEPS (0.1%) 0-KTRIAC_POWER_STEPS
+#define KTRIAC_SET_POWER                ( 1 << 7)
+//sigma-delta burst: whole half phases on mark of every mark + space, value: KTRIAC_BURST_* flags
+#define KTRIAC_SET_BURST                ( 1 << 8)
+//phase of the channel in three phase mode: 0 L1, 1 L2, 2 L3
+#define KTRIAC_SET_PHASE                ( 1 << 9)
+#define KTRIAC_SET_ALL                  ( ( 1 << 10) - 1)
+
+//burst in whole cycles, both half phases of a cycle conduct: no DC
+#define KTRIAC_BURST_FULL_CYCLE         ( 1 << 0)
+//longest burst period
+#define KTRIAC_BURST_MAX                1000000
+
+#define KTRIAC_MAX_BATCH                256
+
+struct ktriac_config {
+    __u32 set;                  //KTRIAC_SET_* flags, one power mode at most
+    __u32 channel;
+    __s32 value;                //angle or percent
+    __u32 mark;
+    __u32 space;
+    __u32 fire_time_us;
+    __s32 latency_us;
+    __u32 tolerance;
+    __u32 frequency;
+    __u32 phase;
+};
+
+/*
+ * Power curve: /sys/ktriac/curve holds KTRIAC_POWER_STEPS + 1 native endian __u16,
+ * entry p is where the gate fires for the power p / KTRIAC_POWER_STEPS, in 1/65536
+ * of the half phase. Entry 0 is not used (0 power is off), the entries must not grow
+ * with the power. The default is the exact curve of a resistive load on a sine.
+ */
+#define KTRIAC_POWER_STEPS              1000
+
+//power ramps run by the module, see the ramp utility
+#define KTRIAC_MAX_RAMP                 16
+//ramp actual: start from the actual power of the channel
+#define KTRIAC_RAMP_CURRENT             -2
+
+struct ktriac_ramp_segment {
+    __u32 from;                 //%
+    __u32 to;                   //%
+    __u32 step;                 //%
+    __u32 time_ms;
+};
+
+struct ktriac_ramp {
+    __u32 channel;
+    __s32 actual;               //-1: from the beginning, 0-100: skip the steps until this % (ramp -n), KTRIAC_RAMP_CURRENT
+    __u32 count;
+    __u32 reserved;
+    struct ktriac_ramp_segment segment[ KTRIAC_MAX_RAMP];
+};
+
+struct ktriac_batch {
+    __u32 count;
+    __u32 reserved;
+    __u64 configs;              //pointer to struct ktriac_config[count]
+};
+
+/***********************************
+ * WAVEFORM
+ *
+ * write() on /dev/ktriac plays a setpoint for every half phase: a struct
+ * ktriac_wave_header followed by count struct ktriac_wave_entry. The irq takes
+ * exactly one entry at every accepted zerocross (none when the PLL coasts, that
+ * half phase is skipped), overriding the settings of the channel while playing.
+ * Every channel has two buffers: one is played while the next one is written.
+ * The write blocks (O_NONBLOCK: EAGAIN) until a buffer is free, count 0 stops
+ * the playback at once.
+ * *********************************/
+
+//entries of one buffer
+#define KTRIAC_WAVE_SIZE                1024
+
+//replay the buffer until the next one is written
+#define KTRIAC_WAVE_LOOP                ( 1 << 0)
+//the end of a one-shot playback: running out of entries after it is not an underrun
+#define KTRIAC_WAVE_LAST                ( 1 << 1)
+
+//entry types
+//no gate in this half phase
+#define KTRIAC_WAVE_SKIP                0
+//value: attack angle in deg 0-180, 180 no gate
+#define KTRIAC_WAVE_ANGLE               1
+//value: power in 1/KTRIAC_POWER_STEPS
+#define KTRIAC_WAVE_POWER               2
+
+struct ktriac_wave_entry {
+    __u16 type;
+    __u16 value;
+};
+
+struct ktriac_wave_header {
+    __u32 channel;
+    __u32 flags;                //KTRIAC_WAVE_LOOP, KTRIAC_WAVE_LAST
+    __u32 count;                //entries following the header, at most KTRIAC_WAVE_SIZE
+    __u32 reserved;
+};
+
+struct ktriac_wave_status {
+    __u32 channel;
+    __u32 playing;              //1 while a buffer is played
+    __u32 free;                 //buffers that can be written without blocking
+    __u32 underruns;            //a one-shot buffer ran out without the next one
+    __u64 played;               //entries played so far
+};
+
+/***********************************
+ * SPEED CONTROL
+ *
+ * A PID loop keeps the speed measured on the tachometer input (tacho_gpio
+ * module parameter) at target_rpm, setting the power of one channel at every
+ * accepted zerocross. The output is the power in 1/KTRIAC_POWER_STEPS:
+ *     output = kp * error + sum( ki * error) + kd * ( last rpm - rpm)
+ * with the error in rpm and the gains in 1/1000 power step.
+ * Anti-windup: the integral does not grow further into an output limit and it
+ * stays within -/+ integral_max, or within the output limits if that is 0.
+ * *********************************/
+
+struct ktriac_speed {
+    __s32 channel;              //controlled channel, -1: off
+    __u32 target_rpm;           //0: the channel is off
+    __s32 kp;
+    __s32 ki;
+    __s32 kd;
+    __u32 out_min;              //output limits in 1/KTRIAC_POWER_STEPS
+    __u32 out_max;
+    __u32 pulses_per_rev;       //tacho pulses in a revolution
+    __u32 integral_max;         //limit of the integral in 1/KTRIAC_POWER_STEPS, 0: out_min..out_max
+};
+
+struct ktriac_speed_status {
+    struct ktriac_speed config;
+    __u32 rpm;                  //measured speed, 0: no pulses for KTRIAC_TACHO_TIMEOUT
+    __s32 error;                //target - rpm
+    __s32 integral;             //integral part of the output in 1/KTRIAC_POWER_STEPS
+    __u32 output;               //power set in 1/KTRIAC_POWER_STEPS
+    __u32 pulses;               //accepted tacho pulses
+    __u32 glitches;             //tacho pulses closer than KTRIAC_TACHO_GLITCH
+};
+
+/***********************************
+ * ENERGY
+ *
+ * Every channel sums the energy it delivered from the real gate on times:
+ * the part of the sine energy of the half phase after the gate fired, for a
+ * resistive load. Half phases skipped, missing or late firings are counted
+ * as they were, the time stops while the mains is lost.
+ * *********************************/
+
+//zero the counters of the channel after reading them
+#define KTRIAC_ENERGY_RESET             ( 1 << 0)
+
+struct ktriac_energy {
+    __u32 channel;
+    __u32 flags;                //KTRIAC_ENERGY_RESET
+    __u64 energy_ns;            //energy in ns of full power: * the full power of the load in W = nJ
+    __u64 time_ns;              //length of the half phases counted
+    __u64 half_phases;          //half phases counted
+    __u64 conducted;            //half phases the gate fired in
+    __u32 power_ppm;            //energy_ns / time_ns in ppm
+    __u32 rms;                  //rms voltage on the load in 1/KTRIAC_POWER_STEPS of the mains
+};
+
+/***********************************
+ * LOAD GROUP
+ *
+ * The burst and pwm channels with a rated load share one supply: at every
+ * zerocross the module decides which of them conduct, keeping the total power
+ * of a half phase close to the average of the group instead of switching them
+ * together. The duty of every channel stays as set, a half phase of a channel
+ * is only moved a little later.
+ * *********************************/
+
+//largest rated power of a load in W
+#define KTRIAC_LOAD_MAX                 1000000
+
+struct ktriac_load {
+    __u32 channel;
+    __u32 power_w;              //rated power of the load, 0: not in the group
+};
+
+//zero the peak and the average after reading them
+#define KTRIAC_GROUP_RESET              ( 1 << 0)
+
+struct ktriac_group_status {
+    __u32 flags;                //KTRIAC_GROUP_RESET
+    __u32 members;              //burst and pwm channels with a rated load
+    __u32 rated_w;              //sum of their rated power: the peak without the group
+    __u32 demand_w;             //sum of rated power * duty: the average asked, the peak cannot be lower
+    __u32 limit_w;              //the total the group is planned within now
+    __u32 peak_w;               //highest total of a half phase
+    __u32 average_w;            //average total of the half phases
+    __u32 reserved;
+    __u64 half_phases;          //half phases counted
+};
+
+/***********************************
+ * CONTROL PAGE
+ *
+ * mmap() of /dev/ktriac at KTRIAC_CONTROL_OFFSET gives a struct ktriac_control_status,
+ * read only: the zerocross the channels fired from last, the predicted next one, the
+ * half period of the mains and the state of the channels, updated at every zerocross.
+ * The next page (KTRIAC_CONTROL_OFFSET + page_size, writable with a file open for
+ * writing) holds a struct ktriac_setpoint for every channel: the irq samples them at
+ * every zerocross, a control loop sets the power and follows the mains without syscalls.
+ *
+ * Writing a setpoint: sequence + 1 (odd), type and value, then sequence + 1 with release
+ * ordering. The irq takes it at the next zerocross if the sequence is even, changed, and
+ * the same after reading it, else it keeps the last one for that half phase. The sequence
+ * taken comes back in the status of the channel. A setpoint overrides the settings and the
+ * speed control of the channel, the calibration and a playing waveform override it.
+ * Reading the status: sequence, wait while it is odd, copy, sequence again: the copy is
+ * good if it did not change.
+ * *********************************/
+
+//mmap offset of the status page, page_size after it the setpoints
+#define KTRIAC_CONTROL_OFFSET           0x10000000
+//slots of the pages, channels of the module at most
+#define KTRIAC_CONTROL_CHANNELS         16
+
+//setpoint types
+//the settings of the channel apply
+#define KTRIAC_SETPOINT_NONE            0
+//value: attack angle in deg 0-180, 180 no gate
+#define KTRIAC_SETPOINT_ANGLE           1
+//value: power in 1/KTRIAC_POWER_STEPS
+#define KTRIAC_SETPOINT_POWER           2
+
+struct ktriac_setpoint {
+    __u32 sequence;             //odd while written
+    __u32 type;                 //KTRIAC_SETPOINT_*
+    __s32 value;
+    __u32 reserved;
+};
+
+struct ktriac_channel_status {
+    __u32 taken;                //sequence of the setpoint taken last
+    __u32 duty;                 //duty of the current half phase in %
+    __s32 offset_ns;            //three phase mode: the zerocross of the channel is this much later
+    __u32 reserved;
+};
+
+struct ktriac_control_status {
+    __u32 sequence;             //odd while the irq updates the page
+    __u32 channels;
+    __u32 page_size;            //the setpoints are at KTRIAC_CONTROL_OFFSET + page_size
+    __u32 locked;               //1 while the PLL is locked, 0: no firing, next_zerocross is a guess
+    __s64 last_zerocross;       //CLOCK_MONOTONIC ns, the filtered one the channels fire from
+    __s64 next_zerocross;       //predicted
+    __s64 half_period_ns;       //measured half period of the mains
+    struct ktriac_channel_status channel[ KTRIAC_CONTROL_CHANNELS];
+};
+
+#define KTRIAC_IOC_SET                  _IOW( KTRIAC_IOC_MAGIC, 1, struct ktriac_config)
+#define KTRIAC_IOC_SET_BATCH            _IOW( KTRIAC_IOC_MAGIC, 2, struct ktriac_batch)
+//the ramp starts at the next zerocross, stepping on zerocrosses
+#define KTRIAC_IOC_RAMP                 _IOW( KTRIAC_IOC_MAGIC, 4, struct ktriac_ramp)
+//set channel, get its staged settings, the power mode in set
+#define KTRIAC_IOC_GET                  _IOWR( KTRIAC_IOC_MAGIC, 3, struct ktriac_config)
+//set channel, get the state of its waveform playback
+#define KTRIAC_IOC_WAVE_STATUS          _IOWR( KTRIAC_IOC_MAGIC, 5, struct ktriac_wave_status)
+//the speed control, applied at the next zerocross
+#define KTRIAC_IOC_SPEED                _IOW( KTRIAC_IOC_MAGIC, 6, struct ktriac_speed)
+#define KTRIAC_IOC_SPEED_STATUS         _IOR( KTRIAC_IOC_MAGIC, 7, struct ktriac_speed_status)
+//set channel and flags, get the delivered energy of the channel
+#define KTRIAC_IOC_ENERGY               _IOWR( KTRIAC_IOC_MAGIC, 8, struct ktriac_energy)
+//the rated power of a channel, applied at the next zerocross
+#define KTRIAC_IOC_LOAD                 _IOW( KTRIAC_IOC_MAGIC, 9, struct ktriac_load)
+//set flags, get the state of the load group
+#define KTRIAC_IOC_GROUP_STATUS         _IOWR( KTRIAC_IOC_MAGIC, 10, struct ktriac_group_status)
+
+#endif
@@ -1,6 +1,10 @@
 /*********************************************
 *** ramp utility to deal with ktriac kernel module
-*** 
+***
+*** The steps are set at absolute deadlines
+*** (timerfd), or at the zerocross nearest to
+*** them read from /dev/ktriac
+***
 *** Written by The TunguZka Team Hungary
 *** GNU GPLv3 license
 *********************************************/
@@ -10,20 +14,47 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include "../ktriac_uapi.h"
 
 
+#define NSEC_IN_MSEC    1000000LL
+#define NSEC_IN_SEC     1000000000LL
+
+//shape of a segment: the part of the change done at x part of its time
+#define PROFILE_LINEAR  0
+//smoothstep: slow start and end, no jump in the speed of the change
+#define PROFILE_SCURVE  1
+//slow start, fast end: ( e^(kx) - 1) / ( e^k - 1)
+#define PROFILE_EXP     2
+
+#define EXP_FACTOR      4.0
+
 struct ramp_t {
-    unsigned int from;
-    float inc;
-    unsigned int wait;
+    int from, to;
     unsigned int steps;
+    unsigned int profile;
+    //length in ns
+    int64_t time;
 };
 
-#define MAX_RAMP    10
-struct ramp_t ramp[MAX_RAMP];
+struct ramp_t *ramp = NULL;
 unsigned int ramp_count = 0;
 
-const char* usage = "expected format: [from]%-[to]%-steps-duration [ARGS]\n\nArguments:\n-n: the actual percentage\n";
+const char* usage = "expected format: [from]%-[to]%-[step]%-[time in ms][:profile]... [ARGS]\n\n"
+                    "Profiles: linear (default), scurve, exp\n\nArguments:\n"
+                    "-n NUM: the actual percentage, the steps before it are skipped\n"
+                    "-p PROFILE: profile of the next segments without one\n"
+                    "-c CHANNEL: channel to ramp (0)\n"
+                    "-d DEVICE: control device (/dev/ktriac)\n"
+                    "-z: step on the zerocross nearest to the deadline (event ring of the device)\n"
+                    "-o: print the percentages to stdout instead of the device, like: ramp ... > /sys/ktriac/ktriac\n";
 
 
 /*inline*/ void out_of_range( const char* err, int from, int to, int value)
@@ -31,134 +62,393 @@ const char* usage = "expected format: [from]%-[to]%-steps-duration [ARGS]\n\nArg
     printf("%s is out of range: %d [%d-%d]\n", err, value, from, to);
 }
 
-/*inline*/ const char* get_parameter_argument( const char * parameter, char **argv, int index, int count)
+static int parse_profile( const char *name)
+{
+    if ( strcmp( name, "linear") == 0)
+        return PROFILE_LINEAR;
+    if ( strcmp( name, "scurve") == 0)
+        return PROFILE_SCURVE;
+    if ( strcmp( name, "exp") == 0)
+        return PROFILE_EXP;
+
+    return -1;
+}
+
+/*
+ * One percent value with the % sign, the end of it in end
+ */
+static int parse_percent( const char *str, char **end, const char *err)
+{
+    long value = strtol( str, end, 10);
+
+    if ( *end == str || **end != '%')
+    {
+        printf("Wrong %s: %s\n", err, str);
+        exit( EXIT_FAILURE);
+    }
+
+    ++*end;
+    return value;
+}
+
+/*
+ * [from]%-[to]%-[step]%-[time][:profile], returns 0 if it is not a segment
+ */
+static int parse_segment( const char *arg, struct ramp_t *segment, int profile)
+{
+    char *end;
+    int step, shape = profile;
+    long time;
+
+    if ( arg[0] < '0' || arg[0] > '9')
+        return 0;
+
+    segment->from = parse_percent( arg, &end, "[from value]");
+    if ( *end++ != '-')
+        return 0;
+
+    segment->to = parse_percent( end, &end, "[to value]");
+    if ( *end++ != '-')
+        return 0;
+
+    step = parse_percent( end, &end, "[step value]");
+    if ( *end++ != '-')
+        return 0;
+
+    time = strtol( end, &end, 10);
+
+    if ( *end == ':' && ( shape = parse_profile( end + 1)) < 0)
+    {
+        printf("Unknown profile: %s\n", end + 1);
+        exit( EXIT_FAILURE);
+    }
+    else
+    if ( *end && *end != ':')
+        return 0;
+
+    if ( segment->from < 0 || segment->from > 100)
+    {
+        out_of_range( "argument [from value]", 0, 100, segment->from);
+        exit( EXIT_FAILURE);
+    }
+
+    if ( segment->to < 0 || segment->to > 100)
+    {
+        out_of_range( "argument [to value]", 0, 100, segment->to);
+        exit( EXIT_FAILURE);
+    }
+
+    if ( step < 0 || step > 100)
+    {
+        out_of_range( "argument [steps value]", 0, 100, step);
+        exit( EXIT_FAILURE);
+    }
+
+    if ( time < 0 || time > 1000000000L)
+    {
+        out_of_range( "argument [time value]", 0, 1000000000, time);
+        exit( EXIT_FAILURE);
+    }
+
+    //the same count as the ramp of the module (set_triac_ramp): a remainder is no step of its own
+    if ( segment->from == segment->to || step == 0)
+        segment->steps = 1;
+    else
+        segment->steps = abs( segment->to - segment->from) / step;
+
+    if ( segment->steps == 0)
+        segment->steps = 1;
+
+    segment->time = time * NSEC_IN_MSEC;
+    segment->profile = shape;
+
+    return 1;
+}
+
+static double profile_shape( unsigned int profile, double x)
 {
-    if ( index < 0 || index + 1 >= count)
-        return NULL;
-    
-    if ( strcmp( parameter, argv[index]) == 0)
-        return argv[ index + 1];
-    
-    return NULL;
+    switch ( profile)
+    {
+        case PROFILE_SCURVE:
+            return x * x * ( 3 - 2 * x);
+        case PROFILE_EXP:
+            return ( exp( EXP_FACTOR * x) - 1) / ( exp( EXP_FACTOR) - 1);
+    }
+
+    return x;
+}
+
+/*
+ * Step j (1..steps) of the segment: the value in 0.1% and its time since the start of the segment,
+ * the first step is at once, the last one a step before the end
+ */
+static int step_value( const struct ramp_t *segment, unsigned int j)
+{
+    double x = (double)j / segment->steps;
+
+    return lround( ( segment->from + ( segment->to - segment->from) * profile_shape( segment->profile, x)) * 10);
+}
+
+static int64_t step_time( const struct ramp_t *segment, unsigned int j)
+{
+    return segment->time * ( j - 1) / segment->steps;
+}
+
+static int64_t monotonic_ns( void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * NSEC_IN_SEC + ts.tv_nsec;
+}
+
+/*
+ * Set the power of the channel: on the open device, or printed for a sysfs file
+ */
+static void set_power( int fd, unsigned int channel, int power)
+{
+    struct ktriac_config config;
+
+    if ( fd < 0)
+    {
+        printf("%d%%\n", power / 10);
+        fflush( stdout);
+        return;
+    }
+
+    memset( &config, 0, sizeof( config));
+    config.set = KTRIAC_SET_POWER;
+    config.channel = channel;
+    config.value = power;
+
+    if ( ioctl( fd, KTRIAC_IOC_SET, &config))
+    {
+        printf("Cannot set the power: %s\n", strerror( errno));
+        exit( EXIT_FAILURE);
+    }
+}
+
+/*
+ * Wait until the absolute CLOCK_MONOTONIC deadline
+ */
+static void wait_deadline( int timer, int64_t deadline)
+{
+    struct itimerspec its;
+    uint64_t expirations;
+
+    memset( &its, 0, sizeof( its));
+    its.it_value.tv_sec = deadline / NSEC_IN_SEC;
+    its.it_value.tv_nsec = deadline % NSEC_IN_SEC;
+
+    if ( timerfd_settime( timer, TFD_TIMER_ABSTIME, &its, NULL))
+    {
+        printf("Cannot set the timer: %s\n", strerror( errno));
+        exit( EXIT_FAILURE);
+    }
+
+    while ( read( timer, &expirations, sizeof( expirations)) < 0 && errno == EINTR)
+        ;
+}
+
+/*
+ * Wait for the next accepted or coasted zerocross, returns its timestamp,
+ * half is updated with the measured half phase
+ */
+static int64_t wait_zerocross( int fd, int64_t *half)
+{
+    struct ktriac_event events[ 64];
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int64_t zc = 0;
+    ssize_t len;
+    unsigned int i;
+
+    while ( !zc)
+    {
+        int ret = poll( &pfd, 1, 1000);
+
+        if ( ret < 0 && errno == EINTR)
+            continue;
+
+        if ( ret <= 0)
+        {
+            printf("No zerocross events, is DEBUG_DEVICE enabled and the mains present?\n");
+            exit( EXIT_FAILURE);
+        }
+
+        len = read( fd, events, sizeof( events));
+        if ( len < 0)
+        {
+            if ( errno == EAGAIN || errno == EINTR)
+                continue;
+
+            printf("Cannot read the events: %s\n", strerror( errno));
+            exit( EXIT_FAILURE);
+        }
+
+        for ( i = 0; i < len / sizeof( struct ktriac_event); ++i)
+        {
+            if ( events[ i].type != KTRIAC_EVENT_ZEROCROSS)
+                continue;
+
+            //45-65Hz
+            if ( events[ i].data >= 7500 && events[ i].data <= 11200)
+                *half = events[ i].data * 1000LL;
+
+            zc = events[ i].timestamp;
+        }
+    }
+
+    return zc;
 }
 
 int main( int argc, char **argv)
 {
-    
+
     //good start for my ansycron pump:
     //./ramp 0%-70%-10%-77 70%-90%-1%-1000 90%-100%-1%-1000
-    
-    int act_percent = -1;
-    
+
+    const char *device = "/dev/ktriac";
+    int act_percent = -1, profile = PROFILE_LINEAR, zerocross = 0, print = 0;
+    unsigned int channel = 0, first = 1;
+    int64_t start, zc = 0, offset = 0, half = 10 * NSEC_IN_MSEC;
+    int fd = -1, timer = -1, opt;
+
     if ( argc <= 1)
     {
         printf("%s\n", usage);
         exit( EXIT_FAILURE);
     }
-    
-    //build ramp list
-    for ( int i = 1; i < argc; ++i)
+
+    //build ramp list, the segments are not options
+    while ( optind < argc)
     {
-        int from, to, steps, time;
-        const char* parameter = NULL;
-        
-        if ( sscanf( argv[i], "%d%%-%d%%-%d%%-%d", &from, &to, &steps, &time) < 4)
+        struct ramp_t segment;
+
+        if ( parse_segment( argv[ optind], &segment, profile))
         {
-            if ( ( parameter = get_parameter_argument( "-n", argv, i, argc)) != NULL)
+            ramp = realloc( ramp, ( ramp_count + 1) * sizeof( *ramp));
+            if ( !ramp)
             {
-                ++i;
-                int ret = sscanf( parameter, "%d", &act_percent);
-                if ( !ret || act_percent < 0 || act_percent > 100)
-                {
-                    printf("Wrong argument: -n expects [NUM: 0-100] to specify the actual percent\n");
-                    exit( EXIT_FAILURE);
-                }
-                continue;
+                printf("Out of memory\n");
+                exit( EXIT_FAILURE);
             }
-            
-            printf("Wrong argument: %s\n%s\n", argv[i], usage);
-            exit( EXIT_FAILURE);
+
+            ramp[ ramp_count++] = segment;
+            ++optind;
+            continue;
         }
 
-        if ( from < 0 || from > 100)
+        if ( ( opt = getopt( argc, argv, "+n:p:c:d:zo")) == -1)
         {
-            out_of_range( "argument [from value]", 0, 100, from);
+            printf("Wrong argument: %s\n%s\n", argv[ optind], usage);
             exit( EXIT_FAILURE);
         }
-        
-        if ( to < 0 || to > 100)
+
+        switch ( opt)
         {
-            out_of_range( "argument [to value]", 0, 100, to);
-            exit( EXIT_FAILURE);
+            case 'n':
+                if ( sscanf( optarg, "%d", &act_percent) != 1 || act_percent < 0 || act_percent > 100)
+                {
+                    printf("Wrong argument: -n expects [NUM: 0-100] to specify the actual percent\n");
+                    exit( EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                if ( ( profile = parse_profile( optarg)) < 0)
+                {
+                    printf("Unknown profile: %s\n", optarg);
+                    exit( EXIT_FAILURE);
+                }
+                break;
+            case 'c': channel = atoi( optarg); break;
+            case 'd': device = optarg; break;
+            case 'z': zerocross = 1; break;
+            case 'o': print = 1; break;
+            default:
+                printf("%s\n", usage);
+                exit( EXIT_FAILURE);
         }
-            
-        if ( steps < 0)
+    }
+
+    if ( !ramp_count)
+    {
+        printf("%s\n", usage);
+        exit( EXIT_FAILURE);
+    }
+
+    //skip the steps of the first segment before the actual percent, their time as well
+    if ( act_percent >= 0)
+    {
+        int inc = ( ramp[0].to > ramp[0].from);
+
+        for ( first = 1; first < ramp[0].steps; ++first)
         {
-            out_of_range( "argument [steps value]", 0, 1000000, steps);
-            exit( EXIT_FAILURE);
+            int value = step_value( &ramp[0], first);
+
+            if ( ( inc && value >= act_percent * 10) || ( !inc && value <= act_percent * 10))
+                break;
         }
-            
-        if ( time < 0)
+
+        offset = step_time( &ramp[0], first);
+    }
+
+    //the control fd stays open for the whole ramp
+    if ( !print || zerocross)
+    {
+        fd = open( device, O_RDWR | ( ( zerocross) ? O_NONBLOCK : 0));
+        if ( fd < 0)
         {
-            out_of_range( "argument [time value]", 0, 1000000, time);
+            printf("Cannot open %s: %s\n", device, strerror( errno));
             exit( EXIT_FAILURE);
         }
-            
-        ramp[ ramp_count].from = from;
-
-        if ( from == to)
-            ramp[ ramp_count].steps = 1;
-        else
-            ramp[ ramp_count].steps = fabsf( to - from) / (float)steps;
-
-        ramp[ ramp_count].inc = ( float)( to - from) / ( float) ramp[ ramp_count].steps;
-        ramp[ ramp_count].wait = time * 1000 / ramp[ ramp_count].steps;
-        
-//        printf("from: %d\ninc: %5.2f\nsteps: %d\nwait:%d\n", ramp[ ramp_count].from, ramp[ ramp_count].inc, ramp[ ramp_count].steps, ramp[ ramp_count].wait);
-        
-        ++ramp_count;
-        if ( ramp_count >= MAX_RAMP)
+    }
+
+    if ( !zerocross)
+    {
+        timer = timerfd_create( CLOCK_MONOTONIC, 0);
+        if ( timer < 0)
         {
-            printf("Error: too many ramps...max %d ramps\n", MAX_RAMP);
+            printf("Cannot create the timer: %s\n", strerror( errno));
             exit( EXIT_FAILURE);
         }
     }
 
-    if ( act_percent >= 0 && ramp_count)
+    //the ramp starts now or at the next zerocross, every deadline is counted from it
+    start = ( zerocross) ? ( zc = wait_zerocross( fd, &half)) : monotonic_ns();
+    start -= offset;
+
+    for ( unsigned int i = 0; i < ramp_count; ++i)
     {
-        float value = ramp[0].from;
-        register int inc = ( ramp[0].inc > 0);
-        
-        for ( int j = 0; j < ramp[0].steps; ++j)
+        for ( unsigned int j = ( i) ? 1 : first; j <= ramp[i].steps; ++j)
         {
-            value += ramp[0].inc;
-            if ( ( inc && value >= act_percent) || ( !inc && value <= act_percent))
+            int64_t deadline = start + step_time( &ramp[i], j);
+
+            //set at the zerocross nearest to the deadline, taken over at the next one
+            if ( zerocross)
             {
-                ramp[0].steps -= j;
-                ramp[0].from = value - ramp[0].inc;
-                break;
+                while ( zc < deadline - half / 2)
+                    zc = wait_zerocross( fd, &half);
             }
+            else
+                wait_deadline( timer, deadline);
+
+            set_power( ( print) ? -1 : fd, channel, step_value( &ramp[i], j));
         }
-        
-        if ( ( inc && value < act_percent) || ( !inc && value > act_percent))
-        {
-            ramp[0].from = value - ramp[0].inc;
-            ramp[0].steps = 1;
-        }
-    }
-    
-    for ( int i = 0; i < ramp_count; ++i)
-    {
-        float value = ramp[i].from;
-        for ( int j = 0; j < ramp[i].steps; ++j)
-        {            
-            value += ramp[i].inc;
-            printf("%d%%\n", (int) value);
-            fflush( stdout);
-            usleep( ramp[i].wait);
-        }
+
+        start += ramp[i].time;
     }
-    
+
+    //the end of the last segment
+    if ( !zerocross)
+        wait_deadline( timer, start);
+
+    free( ramp);
+
+    if ( timer >= 0)
+        close( timer);
+    if ( fd >= 0)
+        close( fd);
+
     return EXIT_SUCCESS;
 }
-
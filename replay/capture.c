@@ -0,0 +1,245 @@
+/*********************************************
+*** ktriac capture: records the raw zerocross
+*** edges and the settings from the event ring
+*** of /dev/ktriac for replay
+***
+*** Written by The TunguZka Team Hungary
+*** GNU GPLv3 license
+*********************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "capture.h"
+
+
+#define NSEC_IN_SEC     1000000000LL
+#define PARAMETERS      "/sys/module/ktriac/parameters/"
+#define MAX_CHANNELS    64
+//KTRIAC_IOC_GET fills these too, but it flags only the power mode
+#define CAPTURE_CONFIG_SET  ( KTRIAC_SET_FIRE_TIME | KTRIAC_SET_LATENCY | KTRIAC_SET_TOLERANCE | KTRIAC_SET_FREQUENCY | \
+                              KTRIAC_SET_PHASE)
+
+const char* usage = "usage: capture [ARGS] FILE\n\nArguments:\n"
+                    "-T S: capture time, 0: until interrupted (0)\n"
+                    "-d DEVICE: the device of the module (/dev/ktriac)\n";
+
+static volatile sig_atomic_t stop;
+
+static void on_signal( int sig)
+{
+    stop = 1;
+}
+
+/*
+ * A module parameter as a string, "" if it cannot be read
+ */
+static const char *parameter( const char *name)
+{
+    static char value[ 32];
+    char path[ 128];
+    FILE *f;
+
+    snprintf( path, sizeof( path), PARAMETERS "%s", name);
+    value[0] = 0;
+
+    f = fopen( path, "r");
+    if ( f)
+    {
+        if ( !fgets( value, sizeof( value), f))
+            value[0] = 0;
+        fclose( f);
+    }
+
+    return value;
+}
+
+static long long monotonic_ns( void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * NSEC_IN_SEC + ts.tv_nsec;
+}
+
+static void put( FILE *out, const void *data, size_t size)
+{
+    if ( fwrite( data, size, 1, out) != 1)
+    {
+        printf("Cannot write the capture: %s\n", strerror( errno));
+        exit( EXIT_FAILURE);
+    }
+}
+
+static void put_record( FILE *out, long long timestamp, unsigned int type, unsigned int channel, unsigned int value)
+{
+    struct capture_record record;
+
+    memset( &record, 0, sizeof( record));
+    record.timestamp = timestamp;
+    record.type = type;
+    record.channel = channel;
+    record.value = value;
+
+    put( out, &record, sizeof( record));
+}
+
+int main( int argc, char **argv)
+{
+    struct ktriac_config configs[ MAX_CHANNELS];
+    struct ktriac_event events[ 256];
+    struct capture_header header;
+    unsigned long long edges = 0, changes = 0, dropped = 0;
+    const char *device = "/dev/ktriac";
+    double duration = 0;
+    long long end = 0;
+    unsigned int channels, i;
+    int fd, opt;
+    FILE *out;
+
+    while ( ( opt = getopt( argc, argv, "T:d:h")) != -1)
+    {
+        switch ( opt)
+        {
+            case 'T': duration = atof( optarg); break;
+            case 'd': device = optarg; break;
+            default:
+                printf("%s", usage);
+                exit( EXIT_FAILURE);
+        }
+    }
+
+    if ( optind + 1 != argc)
+    {
+        printf("%s", usage);
+        exit( EXIT_FAILURE);
+    }
+
+    if ( parameter( "capture")[0] != 'Y')
+    {
+        printf("The module does not record the edges: echo 1 > " PARAMETERS "capture\n");
+        exit( EXIT_FAILURE);
+    }
+
+    //the event ring is read from the open on
+    fd = open( device, O_RDONLY);
+    if ( fd < 0)
+    {
+        printf("Cannot open %s: %s\n", device, strerror( errno));
+        exit( EXIT_FAILURE);
+    }
+
+    for ( channels = 0; channels < MAX_CHANNELS; ++channels)
+    {
+        memset( &configs[ channels], 0, sizeof( configs[ channels]));
+        configs[ channels].channel = channels;
+
+        if ( ioctl( fd, KTRIAC_IOC_GET, &configs[ channels]))
+            break;
+
+        configs[ channels].set |= CAPTURE_CONFIG_SET;
+    }
+
+    out = fopen( argv[ optind], "wb");
+    if ( !out)
+    {
+        printf("Cannot create %s: %s\n", argv[ optind], strerror( errno));
+        exit( EXIT_FAILURE);
+    }
+
+    memset( &header, 0, sizeof( header));
+    header.magic = CAPTURE_MAGIC;
+    header.version = CAPTURE_VERSION;
+    header.channels = channels;
+    header.dual_edge = ( parameter( "dual_edge")[0] == 'Y');
+    //an array parameter: the pins, empty without the phase inputs
+    header.phase_inputs = ( parameter( "phase_gpios")[0] >= '0' && parameter( "phase_gpios")[0] <= '9');
+    header.merge_window = atoll( parameter( "merge_window"));
+    header.start = monotonic_ns();
+    put( out, &header, sizeof( header));
+
+    for ( i = 0; i < channels; ++i)
+    {
+        put_record( out, header.start, CAPTURE_CONFIG, i, 0);
+        put( out, &configs[ i], sizeof( configs[ i]));
+    }
+
+    signal( SIGINT, on_signal);
+    signal( SIGTERM, on_signal);
+
+    if ( duration > 0)
+        end = header.start + (long long)( duration * NSEC_IN_SEC);
+
+    while ( !stop && ( !end || monotonic_ns() < end))
+    {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        ssize_t len;
+
+        if ( poll( &pfd, 1, 100) <= 0)
+            continue;
+
+        len = read( fd, events, sizeof( events));
+        if ( len < 0)
+        {
+            if ( errno == EINTR)
+                continue;
+
+            printf("Cannot read the events: %s\n", strerror( errno));
+            exit( EXIT_FAILURE);
+        }
+
+        for ( i = 0; i < len / sizeof( struct ktriac_event); ++i)
+        {
+            struct ktriac_event *event = &events[ i];
+            struct ktriac_config config;
+
+            switch ( event->type)
+            {
+                case KTRIAC_EVENT_EDGE:
+                    put_record( out, event->timestamp, CAPTURE_EDGE, event->channel, event->data);
+                    ++edges;
+                    break;
+
+                //the settings taken over at this zerocross: the staged ones by now
+                case KTRIAC_EVENT_CONFIG:
+                    memset( &config, 0, sizeof( config));
+                    config.channel = event->channel;
+                    if ( ioctl( fd, KTRIAC_IOC_GET, &config))
+                        break;
+
+                    config.set |= CAPTURE_CONFIG_SET;
+
+                    put_record( out, event->timestamp, CAPTURE_CONFIG, event->channel, 0);
+                    put( out, &config, sizeof( config));
+                    ++changes;
+                    break;
+
+                case KTRIAC_EVENT_DROPPED:
+                    put_record( out, event->timestamp, CAPTURE_DROPPED, 0, event->data);
+                    dropped += event->data;
+                    break;
+            }
+        }
+    }
+
+    if ( fclose( out))
+    {
+        printf("Cannot write the capture: %s\n", strerror( errno));
+        exit( EXIT_FAILURE);
+    }
+
+    close( fd);
+
+    printf("Captured: %u channels, %llu edges, %llu setting changes, %llu events dropped, %.1f s\n",
+           channels, edges, changes, dropped, ( monotonic_ns() - header.start) / 1e9);
+
+    return EXIT_SUCCESS;
+}
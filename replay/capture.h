@@ -0,0 +1,52 @@
+/*********************************************
+*** ktriac capture file: the raw zerocross
+*** edges and the settings in effect, written
+*** by capture and read by replay
+***
+*** Written by The TunguZka Team Hungary
+*** GNU GPLv3 license
+*********************************************/
+
+#ifndef KTRIAC_CAPTURE_H
+#define KTRIAC_CAPTURE_H
+
+#include <linux/types.h>
+#include "../ktriac_uapi.h"
+
+
+/*
+ * The file is a struct capture_header and struct capture_record-s in time order,
+ * native endian. A CAPTURE_CONFIG record is followed by a struct ktriac_config.
+ * The first records are the settings of every channel at the start.
+ */
+#define CAPTURE_MAGIC                   0x4352544b      //"KTRC"
+#define CAPTURE_VERSION                 2
+
+//edge of the zerocross input, value: level (1 without dual edge mode),
+//channel: the phase of the input in three phase mode (1: L2, 2: L3, rising edges only)
+#define CAPTURE_EDGE                    1
+//new settings of the channel, taken over at the next zerocross
+#define CAPTURE_CONFIG                  2
+//the capture lost value events of the module here: the replay is not exact around it
+#define CAPTURE_DROPPED                 3
+
+struct capture_header {
+    __u32 magic;
+    __u32 version;
+    __u32 channels;
+    __u32 dual_edge;            //module parameters
+    __s64 merge_window;         //ns
+    __s64 start;                //CLOCK_MONOTONIC ns
+    //version 2: L2 and L3 have zerocross inputs (phase_gpios)
+    __u32 phase_inputs;
+    __u32 reserved;
+};
+
+struct capture_record {
+    __s64 timestamp;            //CLOCK_MONOTONIC ns
+    __u32 value;
+    __u16 type;
+    __u16 channel;
+};
+
+#endif
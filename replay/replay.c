@@ -0,0 +1,385 @@
+/*********************************************
+*** ktriac replay: feeds a capture through the
+*** timing core and lists the gate switching
+*** it makes, compares it with another listing
+***
+*** Written by The TunguZka Team Hungary
+*** GNU GPLv3 license
+*********************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stddef.h>
+#include "ktriac_core.h"
+#include "capture.h"
+
+
+#define NSEC_IN_SEC     1000000000LL
+
+const char* usage = "usage: replay [ARGS] CAPTURE\n\nArguments:\n"
+                    "-o FILE: write the listing to FILE (stdout)\n"
+                    "-q: no listing, the summary only\n"
+                    "-M NS: merge window (from the capture)\n"
+                    "-x FILE: compare the gate pulses with the listing of another build\n"
+                    "-t US: fire times closer than this are the same in the comparison (1)\n"
+                    "-n NUM: differences printed at most (20)\n";
+
+/*
+ * Gate on times of every channel: this run or a listing read back
+ */
+struct fires {
+    s64 *time;
+    size_t count, size;
+};
+
+struct replay {
+    struct ktriac_core core;
+    s64 now;
+    //armed timer, 0: idle
+    s64 timerAt;
+    FILE *listing;
+    struct fires fires[ KTRIAC_MAX_CHANNELS];
+    unsigned long long records, edges, phaseEdges, configs, dropped, switches;
+    //results of the core for the edges by KTRIAC_REASON_*
+    unsigned long long reasons[ KTRIAC_REASON_WIDTH + 1];
+};
+
+static void fires_add( struct fires *fires, s64 time)
+{
+    if ( fires->count == fires->size)
+    {
+        fires->size = ( fires->size) ? fires->size * 2 : 4096;
+        fires->time = realloc( fires->time, fires->size * sizeof( s64));
+        if ( !fires->time)
+        {
+            printf("Out of memory\n");
+            exit( EXIT_FAILURE);
+        }
+    }
+
+    fires->time[ fires->count++] = time;
+}
+
+static void replay_gate( void *ctx, unsigned int channel, unsigned int on)
+{
+    struct replay *replay = ctx;
+
+    ++replay->switches;
+
+    if ( on)
+        fires_add( &replay->fires[ channel], replay->now);
+
+    if ( replay->listing)
+        fprintf( replay->listing, "%lld %u %s\n", (long long)replay->now, channel, ( on) ? "on" : "off");
+}
+
+//an ideal timer: the callback runs at expires
+static void replay_arm( void *ctx, s64 expires)
+{
+    struct replay *replay = ctx;
+
+    replay->timerAt = expires;
+}
+
+static const struct ktriac_hw replay_hw = {
+    .gate = replay_gate,
+    .arm = replay_arm,
+};
+
+/*
+ * Timer callbacks due before until, like the hrtimer of the module
+ */
+static void replay_timer( struct replay *replay, s64 until, s64 mergeWindow)
+{
+    while ( replay->timerAt && replay->timerAt < until)
+    {
+        s64 next;
+
+        replay->now = replay->timerAt;
+        replay->timerAt = 0;
+        next = ktriac_core_timer( &replay->core, replay->now, mergeWindow);
+
+        if ( next && !replay->timerAt)
+            replay->timerAt = next;
+    }
+}
+
+static void read_exact( FILE *in, void *data, size_t size, const char *name)
+{
+    if ( fread( data, size, 1, in) != 1)
+    {
+        printf("%s: truncated capture\n", name);
+        exit( EXIT_FAILURE);
+    }
+}
+
+/*
+ * Gate on times of the listing of another build
+ */
+static void listing_read( const char *name, struct fires *fires)
+{
+    char line[ 128], action[ 8];
+    long long time;
+    unsigned int channel;
+    FILE *in = fopen( name, "r");
+
+    if ( !in)
+    {
+        printf("Cannot open %s\n", name);
+        exit( EXIT_FAILURE);
+    }
+
+    while ( fgets( line, sizeof( line), in))
+        if ( sscanf( line, "%lld %u %7s", &time, &channel, action) == 3 && channel < KTRIAC_MAX_CHANNELS &&
+             strcmp( action, "on") == 0)
+            fires_add( &fires[ channel], time);
+
+    fclose( in);
+}
+
+/*
+ * Pair the fires of the two runs: the same time within half a half phase is the same
+ * fire. Prints the ones missing from either and the ones moved more than tolerance.
+ */
+static void compare( struct fires *ours, struct fires *theirs, unsigned int channels, s64 tolerance, unsigned int limit)
+{
+    unsigned long long same = 0, moved = 0, missing = 0, extra = 0, printed = 0;
+    s64 maxShift = 0, window = NSEC_IN_SEC / 200;
+    double sum = 0;
+    unsigned int i;
+
+    for ( i = 0; i < channels; ++i)
+    {
+        size_t a = 0, b = 0;
+
+        while ( a < ours[ i].count || b < theirs[ i].count)
+        {
+            s64 x = ( a < ours[ i].count) ? ours[ i].time[ a] : 0;
+            s64 y = ( b < theirs[ i].count) ? theirs[ i].time[ b] : 0;
+
+            if ( a < ours[ i].count && b < theirs[ i].count && llabs( x - y) < window)
+            {
+                s64 shift = x - y;
+
+                if ( llabs( shift) > tolerance)
+                {
+                    ++moved;
+                    if ( printed++ < limit)
+                        printf("Channel %u: fire at %lld moved %+.1f us\n", i, (long long)y, shift / 1000.0);
+                }
+                else
+                    ++same;
+
+                if ( llabs( shift) > llabs( maxShift))
+                    maxShift = shift;
+                sum += shift;
+                ++a;
+                ++b;
+            }
+            else
+            if ( b >= theirs[ i].count || ( a < ours[ i].count && x < y))
+            {
+                ++extra;
+                if ( printed++ < limit)
+                    printf("Channel %u: new fire at %lld\n", i, (long long)x);
+                ++a;
+            }
+            else
+            {
+                ++missing;
+                if ( printed++ < limit)
+                    printf("Channel %u: no fire at %lld\n", i, (long long)y);
+                ++b;
+            }
+        }
+    }
+
+    printf("Compared: same: %llu moved: %llu new: %llu missing: %llu max shift: %+.1f us mean shift: %+.3f us\n",
+           same, moved, extra, missing, maxShift / 1000.0, ( same + moved) ? sum / ( same + moved) / 1000.0 : 0);
+}
+
+int main( int argc, char **argv)
+{
+    struct replay *replay = calloc( 1, sizeof( *replay));
+    struct fires theirs[ KTRIAC_MAX_CHANNELS];
+    struct capture_header header;
+    struct capture_record record;
+    struct ktriac_config config;
+    const char *output = NULL, *other = NULL;
+    s64 mergeWindow = -1, tolerance = 1000, first = 0;
+    unsigned int limit = 20, quiet = 0, i;
+    struct timespec start, stop;
+    double wall;
+    int opt;
+    FILE *in;
+
+    if ( !replay)
+        exit( EXIT_FAILURE);
+
+    while ( ( opt = getopt( argc, argv, "o:qM:x:t:n:h")) != -1)
+    {
+        switch ( opt)
+        {
+            case 'o': output = optarg; break;
+            case 'q': quiet = 1; break;
+            case 'M': mergeWindow = atoll( optarg); break;
+            case 'x': other = optarg; break;
+            case 't': tolerance = atof( optarg) * 1000; break;
+            case 'n': limit = atoi( optarg); break;
+            default:
+                printf("%s", usage);
+                exit( EXIT_FAILURE);
+        }
+    }
+
+    if ( optind + 1 != argc)
+    {
+        printf("%s", usage);
+        exit( EXIT_FAILURE);
+    }
+
+    in = fopen( argv[ optind], "rb");
+    if ( !in)
+    {
+        printf("Cannot open %s\n", argv[ optind]);
+        exit( EXIT_FAILURE);
+    }
+
+    //version 1 ends before phase_inputs
+    memset( &header, 0, sizeof( header));
+    read_exact( in, &header, offsetof( struct capture_header, phase_inputs), argv[ optind]);
+    if ( header.magic != CAPTURE_MAGIC || header.version == 0 || header.version > CAPTURE_VERSION ||
+         header.channels == 0 || header.channels > KTRIAC_MAX_CHANNELS)
+    {
+        printf("%s: not a capture of this version\n", argv[ optind]);
+        exit( EXIT_FAILURE);
+    }
+
+    if ( header.version >= 2)
+        read_exact( in, &header.phase_inputs, sizeof( header) - offsetof( struct capture_header, phase_inputs), argv[ optind]);
+
+    if ( mergeWindow < 0)
+        mergeWindow = header.merge_window;
+
+    if ( !quiet)
+    {
+        replay->listing = stdout;
+        if ( output && !( replay->listing = fopen( output, "w")))
+        {
+            printf("Cannot create %s\n", output);
+            exit( EXIT_FAILURE);
+        }
+
+        fprintf( replay->listing, "# channels: %u dual edge: %u phase inputs: %u merge window: %lld ns\n",
+                 header.channels, header.dual_edge, header.phase_inputs, (long long)mergeWindow);
+    }
+
+    ktriac_core_init( &replay->core, &replay_hw, replay, header.channels);
+    if ( header.phase_inputs)
+        ktriac_core_phase_inputs( &replay->core);
+
+    clock_gettime( CLOCK_MONOTONIC, &start);
+
+    while ( fread( &record, sizeof( record), 1, in) == 1)
+    {
+        ++replay->records;
+        if ( !first)
+            first = record.timestamp;
+
+        //the timer events before the record, a setting taken over at
+        //a zerocross was written before it
+        replay_timer( replay, record.timestamp, mergeWindow);
+        replay->now = record.timestamp;
+
+        switch ( record.type)
+        {
+            case CAPTURE_EDGE:
+                //the inputs of L2 and L3
+                if ( record.channel)
+                {
+                    ++replay->phaseEdges;
+                    ktriac_core_phase( &replay->core, record.channel, replay->now);
+                    break;
+                }
+
+                ++replay->edges;
+
+                //in dual edge mode the end of the pulse decides
+                if ( header.dual_edge)
+                {
+                    unsigned int reason = ktriac_core_pulse( &replay->core, replay->now, record.value);
+
+                    if ( record.value)
+                        ++replay->reasons[ reason];
+                }
+                else
+                    ++replay->reasons[ ktriac_core_edge( &replay->core, replay->now)];
+                break;
+
+            case CAPTURE_CONFIG:
+                read_exact( in, &config, sizeof( config), argv[ optind]);
+                ++replay->configs;
+
+                if ( config.channel >= header.channels || config_check( &replay->core, &config))
+                {
+                    printf("Wrong settings of channel %u at %lld\n", config.channel, (long long)record.timestamp);
+                    break;
+                }
+
+                config_apply( &replay->core.staged, &config);
+                ktriac_core_publish( &replay->core);
+                break;
+
+            case CAPTURE_DROPPED:
+                replay->dropped += record.value;
+                if ( replay->listing)
+                    fprintf( replay->listing, "# %lld dropped %u events\n", (long long)record.timestamp, record.value);
+                break;
+        }
+    }
+
+    //the gate pulses still scheduled
+    replay_timer( replay, replay->now + NSEC_IN_SEC, mergeWindow);
+
+    clock_gettime( CLOCK_MONOTONIC, &stop);
+    wall = ( stop.tv_sec - start.tv_sec) + ( stop.tv_nsec - start.tv_nsec) / 1e9;
+
+    fclose( in);
+    if ( replay->listing && replay->listing != stdout)
+        fclose( replay->listing);
+
+    //the summary goes after the listing on stdout
+    printf("Capture: %.1f s, %llu records, %llu edges, %llu setting changes, %llu events dropped\n",
+           ( replay->now - first) / 1e9, replay->records, replay->edges, replay->configs, replay->dropped);
+    if ( replay->phaseEdges)
+        printf("Phase edges: %llu rejected: %u faults: %u\n", replay->phaseEdges,
+               replay->core.phases[ 1].rejected + replay->core.phases[ 2].rejected, replay->core.phaseFaults);
+    printf("Accepted: %llu late: %llu rejected glitch: %llu early: %llu width: %llu coasted: %u\n",
+           replay->reasons[ KTRIAC_REASON_NONE] + replay->reasons[ KTRIAC_REASON_LATE], replay->reasons[ KTRIAC_REASON_LATE],
+           replay->reasons[ KTRIAC_REASON_GLITCH], replay->reasons[ KTRIAC_REASON_EARLY], replay->reasons[ KTRIAC_REASON_WIDTH],
+           replay->core.pllCoastedTotal);
+
+    for ( i = 0; i < header.channels; ++i)
+        printf("Channel %u: %zu fires\n", i, replay->fires[ i].count);
+
+    printf("Replayed in %.3f s, %.0fx real time\n", wall, ( wall > 0) ? ( replay->now - first) / 1e9 / wall : 0);
+
+    if ( other)
+    {
+        memset( theirs, 0, sizeof( theirs));
+        listing_read( other, theirs);
+        compare( replay->fires, theirs, header.channels, tolerance, limit);
+
+        for ( i = 0; i < KTRIAC_MAX_CHANNELS; ++i)
+            free( theirs[ i].time);
+    }
+
+    for ( i = 0; i < KTRIAC_MAX_CHANNELS; ++i)
+        free( replay->fires[ i].time);
+    free( replay);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,819 @@
+/*********************************************
+*** ktriac simulator: drives the timing core
+*** with a synthetic zerocross signal and
+*** measures the error of the gate pulses
+***
+*** Written by The TunguZka Team Hungary
+*** GNU GPLv3 license
+*********************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#if defined( __x86_64__) || defined( __i386__)
+    #include <x86intrin.h>
+#endif
+#include "../ktriac_core.h"
+#include "../replay/capture.h"
+
+
+#define NSEC_IN_SEC     1000000000LL
+
+//calls into the core are timed in TSC cycles where there is one, in ns elsewhere
+#if defined( __x86_64__) || defined( __i386__)
+    #define CYCLES_UNIT     "cycles"
+    static inline unsigned long long cycles( void) { return __rdtsc(); }
+#else
+    #define CYCLES_UNIT     "ns"
+    static inline unsigned long long cycles( void)
+    {
+        struct timespec ts;
+
+        clock_gettime( CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * NSEC_IN_SEC + ts.tv_nsec;
+    }
+#endif
+
+const char* usage = "usage: sim [ARGS]\n\nArguments:\n"
+                    "-f HZ: mains frequency (50)\n"
+                    "-D MHZ: frequency drift in mHz/s (0)\n"
+                    "-N HZ: frequency setting of the core, 0: detect 50 or 60Hz (AC_DEFAULT_FREQ)\n"
+                    "-j US: sigma of the zerocross irq jitter (20)\n"
+                    "-d US: delay of the detection circuit (0)\n"
+                    "-n RATE: noise pulses per second (0)\n"
+                    "-m PROB: probability of a missing zerocross edge (0)\n"
+                    "-P US: dual edge mode, width of the zerocross pulse (0: rising edge only)\n"
+                    "-C US: calibrate channel 0 on the sense input, the TRIAC latches with this gate pulse\n"
+                    "-3 MODE: three phase, channel N on L(N % 3 + 1). 1: derived offsets, 2: phase inputs, 3: phase inputs, reversed sequence\n"
+                    "-L S: the L3 input is lost after S seconds (-3 2)\n"
+                    "-t US: sigma of the timer latency (10)\n"
+                    "-c NUM: number of channels (1)\n"
+                    "-a DEG: attack angle of the first channel (90)\n"
+                    "-s DEG: angle difference of the next channels (0)\n"
+                    "-p POWER: power in 0.1% instead of the angle, -s is in 0.1% then\n"
+                    "-b N:M: sigma-delta burst, N of every N+M half phases\n"
+                    "-F: burst in full cycles\n"
+                    "-g W: every channel is in the load group with this rated power\n"
+                    "-u PROB: the channels are driven through the setpoints of the control page (-a or -p),\n"
+                    "         PROB of a setpoint being written at the zerocross\n"
+                    "-l US: zerocross latency setting of the core (0)\n"
+                    "-M NS: merge window (TRIAC_DEFAULT_MERGE_WINDOW)\n"
+                    "-T S: simulated time (60)\n"
+                    "-w MS: warm up, not measured (1000)\n"
+                    "-S SEED: random seed (1)\n"
+                    "-H: print the histograms of the core like debugfs\n"
+                    "-R FILE: write the zerocross edges and the settings to a capture for replay\n";
+
+/*
+ * The simulated platform: clock, mains, timer and the measurement
+ */
+struct sim {
+    struct ktriac_core core;
+    s64 now;
+
+    //mains: the real zerocrosses and the edge of the detection circuit
+    double freq, drift;
+    s64 zerocross[ 4];
+    unsigned int zerocrossCount;
+    s64 edgeAt;
+    unsigned int edgeMissing;
+    //dual edge mode: the edge at edgeAt is edgeLevel, the pulse ends at riseAt
+    double pulseWidth;
+    unsigned int edgeLevel;
+    s64 riseAt;
+    double jitter, delay, missing;
+
+    //three phase: the next edges of the L2 and L3 inputs (0: none), L3 gets lost at phaseLostAt
+    unsigned int threePhase;
+    s64 phaseAt[ KTRIAC_PHASES], phaseLostAt;
+
+    //load current sense: the TRIAC latches with a gate pulse of latch ns,
+    //the sense input goes high at senseAt, low at senseEnd (the real zerocross)
+    double latch;
+    s64 onAt[ KTRIAC_MAX_CHANNELS];
+    s64 senseAt, senseEnd;
+    unsigned int senseLevel;
+
+    //noise pulses on the zerocross input
+    double noiseRate;
+    s64 noiseAt;
+
+    //armed timer, 0: idle; timerFire: when its callback runs
+    s64 timerAt, timerFire;
+    double timerJitter;
+
+    s64 warmup;
+    //ideal gate position of the channels in 1/65536 of the half phase,
+    //from the real zerocross of their phase: shift after the one of L1
+    s64 position[ KTRIAC_MAX_CHANNELS], shift[ KTRIAC_MAX_CHANNELS];
+
+    //firing errors in ns
+    s64 *errors;
+    size_t errorCount, errorSize;
+    unsigned long long halfPhases, calls;
+    //time of the edge and the timer calls, like the irq and the hrtimer callback
+    struct cost {
+        unsigned int *samples;
+        size_t count, size;
+    } edgeCost, timerCost;
+    unsigned long long edges, missed, noise;
+    //results of ktriac_core_edge by KTRIAC_REASON_*
+    unsigned long long reasons[ KTRIAC_REASON_WIDTH + 1];
+
+    unsigned long long rng;
+
+    //control page: a control loop writes the setpoints after every zerocross, torn is the
+    //probability of one still being written at the next; the predicted zerocross is checked
+    double torn;
+    struct ktriac_control_status status;
+    struct ktriac_setpoint setpoints[ KTRIAC_CONTROL_CHANNELS];
+    struct ktriac_setpoint setpoint[ KTRIAC_MAX_CHANNELS];
+    unsigned long long setpointWrites, setpointTorn, predictions;
+    double predictionError, predictionAbs;
+
+    //capture of the edges fed to the core
+    FILE *capture;
+};
+
+static double sim_random( struct sim *sim)
+{
+    //xorshift64*
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+
+    return ( ( sim->rng * 2685821657736338717ULL) >> 11) * ( 1.0 / 9007199254740992.0);
+}
+
+static double sim_gauss( struct sim *sim)
+{
+    double u = sim_random( sim), v = sim_random( sim);
+
+    return sqrt( -2.0 * log( u + 1e-300)) * cos( 2.0 * M_PI * v);
+}
+
+/*
+ * Next real zerocross of the mains and the edge the detection circuit makes of it
+ */
+static void sim_next_zerocross( struct sim *sim)
+{
+    s64 last = sim->zerocross[ ( sim->zerocrossCount - 1) & 3];
+    double freq = sim->freq + sim->drift * last / NSEC_IN_SEC;
+    unsigned int i;
+
+    sim->zerocross[ sim->zerocrossCount++ & 3] = last + (s64)( NSEC_IN_SEC / ( 2 * freq));
+
+    //the inputs of L2 and L3 cross 2/3 and 1/3 of the half phase after L1, the other way round
+    //when reversed; the rising edge ends the pulse in dual edge mode
+    for ( i = 1; i < KTRIAC_PHASES && sim->threePhase >= 2; ++i)
+    {
+        double place = ( ( i == 1) ^ ( sim->threePhase == 3)) ? 2.0 / 3 : 1.0 / 3;
+
+        sim->phaseAt[ i] = last + (s64)( ( sim->zerocross[ ( sim->zerocrossCount - 1) & 3] - last) * place +
+                                         sim->delay + sim->pulseWidth / 2 + fabs( sim_gauss( sim) * sim->jitter));
+
+        if ( i == 2 && sim->phaseLostAt && last >= sim->phaseLostAt)
+            sim->phaseAt[ i] = 0;
+    }
+
+    last = sim->zerocross[ ( sim->zerocrossCount - 1) & 3];
+
+    if ( last >= sim->warmup)
+        ++sim->halfPhases;
+
+    //irq latency is never negative
+    sim->edgeAt = last + (s64)( sim->delay + fabs( sim_gauss( sim) * sim->jitter));
+    sim->edgeMissing = ( sim_random( sim) < sim->missing);
+    sim->edgeLevel = 1;
+
+    //the low pulse is centered on the zerocross
+    if ( sim->pulseWidth > 0)
+    {
+        sim->riseAt = sim->edgeAt + (s64)( sim->pulseWidth / 2);
+        sim->edgeAt = last + (s64)( sim->delay - sim->pulseWidth / 2 + fabs( sim_gauss( sim) * sim->jitter));
+        sim->edgeLevel = 0;
+    }
+}
+
+static void capture_put( struct sim *sim, s64 timestamp, unsigned int type, unsigned int channel, unsigned int value)
+{
+    struct capture_record record;
+
+    memset( &record, 0, sizeof( record));
+    record.timestamp = timestamp;
+    record.type = type;
+    record.channel = channel;
+    record.value = value;
+
+    fwrite( &record, sizeof( record), 1, sim->capture);
+}
+
+static void cost_add( struct cost *cost, unsigned long long value)
+{
+    if ( cost->count == cost->size)
+    {
+        cost->size = ( cost->size) ? cost->size * 2 : 65536;
+        cost->samples = realloc( cost->samples, cost->size * sizeof( unsigned int));
+        if ( !cost->samples)
+        {
+            printf("Out of memory\n");
+            exit( EXIT_FAILURE);
+        }
+    }
+
+    cost->samples[ cost->count++] = ( value > ~0U) ? ~0U : value;
+}
+
+static int compare_uint( const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return ( x > y) - ( x < y);
+}
+
+static void cost_print( const char *name, struct cost *cost)
+{
+    unsigned long long sum = 0;
+    size_t i;
+
+    if ( !cost->count)
+        return;
+
+    for ( i = 0; i < cost->count; ++i)
+        sum += cost->samples[ i];
+
+    qsort( cost->samples, cost->count, sizeof( unsigned int), compare_uint);
+
+    printf("%s: mean: %llu p50: %u p99: %u " CYCLES_UNIT "\n", name, sum / cost->count, cost->samples[ cost->count / 2],
+           cost->samples[ (size_t)( 0.99 * ( cost->count - 1))]);
+}
+
+/*
+ * Edge of the zerocross input to the core, recorded in the capture
+ */
+static unsigned int sim_edge( struct sim *sim, s64 now, unsigned int level)
+{
+    unsigned long long start;
+    unsigned int reason;
+
+    if ( sim->capture)
+        capture_put( sim, now, CAPTURE_EDGE, 0, level);
+
+    start = cycles();
+
+    if ( sim->pulseWidth > 0)
+        reason = ktriac_core_pulse( &sim->core, now, level);
+    else
+        reason = ktriac_core_edge( &sim->core, now);
+
+    cost_add( &sim->edgeCost, cycles() - start);
+
+    return reason;
+}
+
+static void sim_next_noise( struct sim *sim)
+{
+    if ( sim->noiseRate <= 0)
+        return;
+
+    sim->noiseAt = sim->now + (s64)( -log( sim_random( sim) + 1e-300) / sim->noiseRate * NSEC_IN_SEC);
+}
+
+/*
+ * Gate on: compare it with the ideal attack time in the real half phase
+ */
+static void sim_gate( void *ctx, unsigned int channel, unsigned int on)
+{
+    struct sim *sim = ctx;
+    s64 best = 0;
+    unsigned int i;
+
+    if ( on)
+        sim->onAt[ channel] = sim->now;
+    else
+    if ( sim->latch > 0 && channel == 0 && sim->now - sim->onAt[ 0] >= sim->latch)
+    {
+        //conducts till the real zerocross after the gate pulse
+        s64 zc = sim->zerocross[ ( sim->zerocrossCount - 1) & 3];
+
+        if ( zc <= sim->onAt[ 0])
+            zc += zc - sim->zerocross[ ( sim->zerocrossCount - 2) & 3];
+
+        sim->senseAt = sim->now;
+        sim->senseEnd = zc;
+        sim->senseLevel = 1;
+    }
+
+    if ( !on || sim->now < sim->warmup)
+        return;
+
+    for ( i = 0; i < 3 && i + 1 < sim->zerocrossCount; ++i)
+    {
+        s64 zc = sim->zerocross[ ( sim->zerocrossCount - 1 - i) & 3];
+        s64 period = zc - sim->zerocross[ ( sim->zerocrossCount - 2 - i) & 3];
+        s64 error = sim->now - ( zc + ( ( period * ( sim->shift[ channel] + sim->position[ channel])) >> 16));
+
+        if ( i == 0 || llabs( error) < llabs( best))
+            best = error;
+    }
+
+    if ( sim->errorCount == sim->errorSize)
+    {
+        sim->errorSize = ( sim->errorSize) ? sim->errorSize * 2 : 65536;
+        sim->errors = realloc( sim->errors, sim->errorSize * sizeof( s64));
+        if ( !sim->errors)
+        {
+            printf("Out of memory\n");
+            exit( EXIT_FAILURE);
+        }
+    }
+
+    sim->errors[ sim->errorCount++] = best;
+}
+
+static void sim_arm( void *ctx, s64 expires)
+{
+    struct sim *sim = ctx;
+
+    sim->timerAt = expires;
+    sim->timerFire = expires + (s64)fabs( sim_gauss( sim) * sim->timerJitter);
+}
+
+static const struct ktriac_hw sim_hw = {
+    .gate = sim_gate,
+    .arm = sim_arm,
+};
+
+static void hist_print( const char *name, struct ktriac_hist *hist)
+{
+    unsigned int i;
+
+    printf("%s:\n", name);
+
+    for ( i = 0; i < KTRIAC_HIST_BUCKETS; ++i)
+        if ( hist->count[ i])
+            printf("%12llu - %12llu ns: %u\n", ( i) ? 1ULL << ( i - 1) : 0ULL, ( i) ? ( 1ULL << i) - 1 : 0ULL, hist->count[ i]);
+}
+
+static int compare_s64( const void *a, const void *b)
+{
+    s64 x = *(const s64 *)a, y = *(const s64 *)b;
+
+    return ( x > y) - ( x < y);
+}
+
+static double percentile( s64 *sorted, size_t count, double p)
+{
+    if ( !count)
+        return 0;
+
+    return sorted[ (size_t)( p * ( count - 1))] / 1000.0;
+}
+
+/*
+ * The control loop after a zerocross: finish the setpoints left torn, write the next ones
+ * like userspace does, some of them get to the next zerocross half written. The predicted
+ * zerocross of the status page is compared with the real one.
+ */
+static void sim_control( struct sim *sim, unsigned int channels)
+{
+    s64 next = sim->zerocross[ ( sim->zerocrossCount - 1) & 3];
+    unsigned int i;
+
+    if ( sim->now >= sim->warmup && sim->status.locked && !( sim->status.sequence & 1))
+    {
+        sim->predictionError += sim->status.next_zerocross - next;
+        sim->predictionAbs += llabs( sim->status.next_zerocross - next);
+        ++sim->predictions;
+    }
+
+    for ( i = 0; i < channels; ++i)
+    {
+        struct ktriac_setpoint *slot = &sim->setpoints[ i];
+
+        if ( slot->sequence & 1)
+            smp_store_release( &slot->sequence, slot->sequence + 1);
+
+        if ( sim->setpoint[ i].type == KTRIAC_SETPOINT_NONE)
+            continue;
+
+        WRITE_ONCE( slot->sequence, slot->sequence + 1);
+        smp_wmb();
+        slot->type = sim->setpoint[ i].type;
+        slot->value = sim->setpoint[ i].value;
+        ++sim->setpointWrites;
+
+        if ( sim->torn > 0 && sim_random( sim) < sim->torn)
+            ++sim->setpointTorn;
+        else
+            smp_store_release( &slot->sequence, slot->sequence + 1);
+    }
+}
+
+int main( int argc, char **argv)
+{
+    struct sim *sim = calloc( 1, sizeof( *sim));
+    struct ktriac_config config;
+    const char *capture = NULL;
+    double duration = 60, angleStep = 0, latency = 0;
+    s64 mergeWindow = TRIAC_DEFAULT_MERGE_WINDOW, end;
+    unsigned int channels = 1, i, phase;
+    int nominal = AC_DEFAULT_FREQ;
+    int angle = 90, power = -1, opt, histograms = 0, control = 0;
+    unsigned int burstNum = 0, burstSpace = 0, burstFlags = 0, groupLoad = 0;
+    struct timespec start, stop;
+    double wall, bias = 0;
+    s64 *abserr;
+
+    if ( !sim)
+        exit( EXIT_FAILURE);
+
+    sim->freq = 50;
+    sim->jitter = 20000;
+    sim->timerJitter = 10000;
+    sim->warmup = NSEC_IN_SEC;
+    sim->rng = 1;
+
+    while ( ( opt = getopt( argc, argv, "f:D:N:j:d:n:m:P:C:3:L:t:c:a:s:p:b:Fg:u:l:M:T:w:S:HR:h")) != -1)
+    {
+        switch ( opt) {
+            case 'f': sim->freq = atof( optarg); break;
+            case 'D': sim->drift = atof( optarg) / 1000; break;
+            case 'N': nominal = atoi( optarg); break;
+            case 'j': sim->jitter = atof( optarg) * 1000; break;
+            case 'd': sim->delay = atof( optarg) * 1000; break;
+            case 'n': sim->noiseRate = atof( optarg); break;
+            case 'm': sim->missing = atof( optarg); break;
+            case 'P': sim->pulseWidth = atof( optarg) * 1000; break;
+            case 'C': sim->latch = atof( optarg) * 1000; break;
+            case '3': sim->threePhase = atoi( optarg); break;
+            case 'L': sim->phaseLostAt = NSEC_IN_SEC + (s64)( atof( optarg) * NSEC_IN_SEC); break;
+            case 't': sim->timerJitter = atof( optarg) * 1000; break;
+            case 'c': channels = atoi( optarg); break;
+            case 'a': angle = atoi( optarg); break;
+            case 's': angleStep = atof( optarg); break;
+            case 'p': power = atoi( optarg); break;
+            case 'b':
+                if ( sscanf( optarg, "%u:%u", &burstNum, &burstSpace) < 2 || burstNum + burstSpace == 0)
+                {
+                    printf("%s", usage);
+                    exit( EXIT_FAILURE);
+                }
+                break;
+            case 'F': burstFlags = KTRIAC_BURST_FULL_CYCLE; break;
+            case 'g': groupLoad = atoi( optarg); break;
+            case 'u': sim->torn = atof( optarg); control = 1; break;
+            case 'l': latency = atof( optarg); break;
+            case 'M': mergeWindow = atoll( optarg); break;
+            case 'T': duration = atof( optarg); break;
+            case 'w': sim->warmup = atoll( optarg) * 1000000LL; break;
+            case 'S': sim->rng = strtoull( optarg, NULL, 0) | 1; break;
+            case 'H': histograms = 1; break;
+            case 'R': capture = optarg; break;
+            default:
+                printf("%s", usage);
+                exit( EXIT_FAILURE);
+        }
+    }
+
+    if ( channels == 0 || channels > KTRIAC_MAX_CHANNELS || sim->freq <= 0 || nominal < 0 || sim->threePhase > 3)
+    {
+        printf("%s", usage);
+        exit( EXIT_FAILURE);
+    }
+
+    //the same commands as KTRIAC_IOC_SET, taken over at the first zerocross
+    ktriac_core_init( &sim->core, &sim_hw, sim, channels);
+    if ( sim->threePhase >= 2)
+        ktriac_core_phase_inputs( &sim->core);
+    if ( control)
+        ktriac_core_control( &sim->core, &sim->status, sim->setpoints);
+
+    if ( capture)
+    {
+        struct capture_header header;
+
+        sim->capture = fopen( capture, "wb");
+        if ( !sim->capture)
+        {
+            printf("Cannot create %s\n", capture);
+            exit( EXIT_FAILURE);
+        }
+
+        memset( &header, 0, sizeof( header));
+        header.magic = CAPTURE_MAGIC;
+        header.version = CAPTURE_VERSION;
+        header.channels = channels;
+        header.dual_edge = ( sim->pulseWidth > 0);
+        header.merge_window = mergeWindow;
+        header.start = NSEC_IN_SEC;
+        header.phase_inputs = ( sim->threePhase >= 2);
+        fwrite( &header, sizeof( header), 1, sim->capture);
+    }
+
+    for ( i = 0; i < channels; ++i)
+    {
+        memset( &config, 0, sizeof( config));
+        config.set = KTRIAC_SET_LATENCY | KTRIAC_SET_FREQUENCY;
+        config.channel = i;
+        config.latency_us = latency;
+        config.frequency = nominal;
+
+        if ( sim->threePhase)
+        {
+            config.set |= KTRIAC_SET_PHASE;
+            config.phase = i % 3;
+            sim->shift[ i] = ( config.phase == 0) ? 0 : ( ( config.phase == 1) ^ ( sim->threePhase == 3)) ? 43691 : 21845;
+        }
+
+        if ( burstNum + burstSpace)
+        {
+            config.set |= KTRIAC_SET_BURST;
+            config.value = burstFlags;
+            config.mark = burstNum;
+            config.space = burstSpace;
+
+            if ( config_check( &sim->core, &config))
+            {
+                printf("Channel %u: wrong burst %u:%u\n", i, burstNum, burstSpace);
+                exit( EXIT_FAILURE);
+            }
+
+            sim->position[ i] = 0;
+        }
+        else
+        if ( power >= 0)
+        {
+            config.set |= KTRIAC_SET_POWER;
+            config.value = power + (int)( angleStep * i);
+
+            if ( config.value < 1 || config.value >= KTRIAC_POWER_STEPS || config_check( &sim->core, &config))
+            {
+                printf("Channel %u: the power is out of range: %d [1-%d]\n", i, config.value, KTRIAC_POWER_STEPS - 1);
+                exit( EXIT_FAILURE);
+            }
+
+            sim->position[ i] = default_power_curve[ config.value];
+        }
+        else
+        {
+            config.set |= KTRIAC_SET_ANGLE;
+            config.value = angle + (int)( angleStep * i);
+
+            if ( config.value < 1 || config.value > 179 || config_check( &sim->core, &config))
+            {
+                printf("Channel %u: the angle is out of range: %d [1-179]\n", i, config.value);
+                exit( EXIT_FAILURE);
+            }
+
+            sim->position[ i] = ( config.value << 16) / 180;
+        }
+
+        config_apply( &sim->core.staged, &config);
+        set_triac_load( &sim->core.staged, i, groupLoad);
+
+        //the setpoint drives the channel, the settings are off
+        if ( control && !( config.set & KTRIAC_SET_BURST))
+        {
+            sim->setpoint[ i].type = ( config.set & KTRIAC_SET_POWER) ? KTRIAC_SETPOINT_POWER : KTRIAC_SETPOINT_ANGLE;
+            sim->setpoint[ i].value = config.value;
+            set_triac_attack_angle( &sim->core.staged, i, -1);
+        }
+
+        if ( sim->capture)
+        {
+            capture_put( sim, NSEC_IN_SEC, CAPTURE_CONFIG, i, 0);
+            fwrite( &config, sizeof( config), 1, sim->capture);
+        }
+    }
+
+    if ( sim->latch > 0)
+        set_calibration( &sim->core.staged, 0);
+
+    ktriac_core_publish( &sim->core);
+
+    sim->zerocross[ 0] = NSEC_IN_SEC;
+    sim->zerocrossCount = 1;
+    sim->warmup += NSEC_IN_SEC;
+    end = NSEC_IN_SEC + (s64)( duration * NSEC_IN_SEC);
+    sim_next_zerocross( sim);
+    sim->now = NSEC_IN_SEC;
+    sim_next_noise( sim);
+
+    clock_gettime( CLOCK_MONOTONIC, &start);
+
+    while ( sim->now < end)
+    {
+        //like calib_apply() of the module
+        if ( sim->core.reports & REPORT_CALIBRATED)
+        {
+            sim->core.reports &= ~REPORT_CALIBRATED;
+
+            if ( sim->core.calib.state == CALIB_DONE)
+            {
+                set_zerocross_latency( &sim->core.staged, sim->core.calib.latency);
+                sim->core.staged.channel[ 0].fireTime = sim->core.calib.fireResult;
+                ktriac_core_publish( &sim->core);
+            }
+        }
+
+        //the next thing to happen: phase edge, sense edge, zerocross edge, noise pulse or the timer
+        for ( phase = 0, i = 1; i < KTRIAC_PHASES; ++i)
+            if ( sim->phaseAt[ i] && ( !phase || sim->phaseAt[ i] < sim->phaseAt[ phase]))
+                phase = i;
+
+        if ( phase && sim->phaseAt[ phase] <= sim->edgeAt && ( !sim->timerAt || sim->phaseAt[ phase] <= sim->timerFire) &&
+             ( !sim->noiseAt || sim->phaseAt[ phase] <= sim->noiseAt) && ( !sim->senseAt || sim->phaseAt[ phase] <= sim->senseAt))
+        {
+            sim->now = sim->phaseAt[ phase];
+            sim->phaseAt[ phase] = 0;
+
+            if ( sim->capture)
+                capture_put( sim, sim->now, CAPTURE_EDGE, phase, 1);
+            ktriac_core_phase( &sim->core, phase, sim->now);
+        }
+        else
+        if ( sim->senseAt && sim->senseAt <= sim->edgeAt && ( !sim->timerAt || sim->senseAt <= sim->timerFire) &&
+             ( !sim->noiseAt || sim->senseAt <= sim->noiseAt))
+        {
+            sim->now = sim->senseAt;
+            ktriac_core_sense( &sim->core, sim->now, sim->senseLevel);
+
+            sim->senseAt = ( sim->senseLevel) ? sim->senseEnd : 0;
+            sim->senseLevel = 0;
+        }
+        else
+        if ( sim->timerAt && sim->timerFire < sim->edgeAt && ( !sim->noiseAt || sim->timerFire < sim->noiseAt))
+        {
+            unsigned long long start;
+            s64 next;
+
+            sim->now = sim->timerFire;
+            sim->timerAt = 0;
+            start = cycles();
+
+            next = ktriac_core_timer( &sim->core, sim->now, mergeWindow);
+            cost_add( &sim->timerCost, cycles() - start);
+
+            //like hrtimer_is_queued(): the edge may have armed it already
+            if ( next && !sim->timerAt)
+                sim_arm( sim, next);
+        }
+        else
+        if ( sim->noiseAt && sim->noiseAt < sim->edgeAt)
+        {
+            sim->now = sim->noiseAt;
+            ++sim->noise;
+
+            //a 20us pulse in dual edge mode
+            if ( sim->pulseWidth > 0)
+            {
+                sim_edge( sim, sim->now, 0);
+                ++sim->reasons[ sim_edge( sim, sim->now + 20000, 1)];
+            }
+            else
+                ++sim->reasons[ sim_edge( sim, sim->now, 1)];
+
+            sim_next_noise( sim);
+        }
+        else
+        {
+            sim->now = sim->edgeAt;
+
+            if ( sim->edgeMissing)
+            {
+                ++sim->missed;
+                sim_next_zerocross( sim);
+                continue;
+            }
+
+            if ( sim->pulseWidth > 0)
+            {
+                unsigned int reason = sim_edge( sim, sim->now, sim->edgeLevel);
+
+                //the end of the pulse comes next
+                if ( !sim->edgeLevel)
+                {
+                    sim->edgeAt = sim->riseAt;
+                    sim->edgeLevel = 1;
+                    ++sim->calls;
+                    continue;
+                }
+
+                ++sim->reasons[ reason];
+            }
+            else
+                ++sim->reasons[ sim_edge( sim, sim->now, 1)];
+
+            ++sim->edges;
+
+            sim_next_zerocross( sim);
+
+            if ( control)
+                sim_control( sim, channels);
+        }
+
+        ++sim->calls;
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &stop);
+    wall = ( stop.tv_sec - start.tv_sec) + ( stop.tv_nsec - start.tv_nsec) / 1e9;
+
+    abserr = malloc( ( sim->errorCount + 1) * sizeof( s64));
+    for ( i = 0; i < sim->errorCount; ++i)
+    {
+        abserr[ i] = llabs( sim->errors[ i]);
+        bias += sim->errors[ i];
+    }
+
+    if ( sim->errorCount)
+        bias /= sim->errorCount * 1000.0;
+
+    qsort( abserr, sim->errorCount, sizeof( s64), compare_s64);
+
+    printf("Mains: %.3f Hz drift: %.1f mHz/s jitter: %.0f us delay: %.0f us noise: %.1f/s missing: %.4f\n",
+           sim->freq, sim->drift * 1000, sim->jitter / 1000, sim->delay / 1000, sim->noiseRate, sim->missing);
+    printf("Channels: %u angle: %d deg step: %.1f deg timer jitter: %.0f us merge window: %lld ns\n",
+           channels, angle, angleStep, sim->timerJitter / 1000, (long long)mergeWindow);
+    printf("Edges: %llu missing: %llu noise pulses: %llu\n", sim->edges, sim->missed, sim->noise);
+    printf("Accepted: %llu late: %llu rejected glitch: %llu early: %llu width: %llu\n", sim->reasons[ KTRIAC_REASON_NONE] + sim->reasons[ KTRIAC_REASON_LATE],
+           sim->reasons[ KTRIAC_REASON_LATE], sim->reasons[ KTRIAC_REASON_GLITCH], sim->reasons[ KTRIAC_REASON_EARLY], sim->reasons[ KTRIAC_REASON_WIDTH]);
+    printf("PLL: %s coasted: %u schedule overruns: %u\n",
+           ( sim->core.pllLocked) ? "locked" : "unlocked", sim->core.pllCoastedTotal, sim->core.scheduleOverruns);
+    printf("Measured: %.3f Hz drift: %lld mHz/s nominal: %.0f Hz\n", freq_milli( &sim->core) / 1000.0, (long long)freq_drift( &sim->core),
+           ( sim->core.freqNominal) ? NSEC_IN_SEC / 2.0 / sim->core.freqNominal : 0.0);
+    if ( sim->threePhase)
+        printf("Phases: L2: %.1f deg L3: %.1f deg%s%s%s faults: %u rejected edges: %u\n",
+               sim->core.phases[ 1].offset * 180.0 / sim->core.freqPeriod, sim->core.phases[ 2].offset * 180.0 / sim->core.freqPeriod + 180,
+               ( sim->core.phaseFault) ? " stopped" : "", ( sim->core.phases[ 2].fault & PHASE_LOST) ? " L3 lost" : "",
+               ( ( sim->core.phases[ 1].fault | sim->core.phases[ 2].fault) & PHASE_REVERSED) ? " reversed" : "",
+               sim->core.phaseFaults, sim->core.phases[ 1].rejected + sim->core.phases[ 2].rejected);
+    if ( sim->latch > 0)
+        printf("Calibration: %s latency: %d us fire time: %lld us (latch: %.0f us)\n",
+               ( sim->core.calib.state == CALIB_DONE) ? "done" : ( sim->core.calib.state == CALIB_FAILED) ? "failed" : "running",
+               sim->core.calib.latency, (long long)sim->core.calib.fireResult / 1000, sim->latch / 1000);
+    for ( i = 0; i < channels; ++i)
+    {
+        struct triac_channel *ch = &sim->core.channels[ i];
+        double ideal = 1 - sim->position[ i] / 65536.0 + sin( 2 * M_PI * sim->position[ i] / 65536.0) / ( 2 * M_PI);
+        unsigned int ppm = energy_ppm( ch->energy, ch->energyTime);
+
+        printf("Energy %u: power: %.3f%% (ideal: %.3f%%) rms: %.2f%% conducted: %llu of %llu half phases\n", i, ppm / 1e4,
+               ( burstNum + burstSpace) ? 100.0 * burstNum / ( burstNum + burstSpace) : ideal * 100, sqrt( ppm / 1e6) * 100,
+               (unsigned long long)ch->conducted, (unsigned long long)ch->halfPhases);
+    }
+    if ( sim->core.settings->groupMembers)
+        printf("Group: %u channels rated: %u W demand: %u W limit: %u W peak: %u W average: %.1f W\n", sim->core.settings->groupMembers,
+               sim->core.settings->groupRated, sim->core.settings->groupDemand, sim->core.groupLimit, sim->core.groupPeak,
+               ( sim->core.groupHalfPhases) ? (double)sim->core.groupEnergy / sim->core.groupHalfPhases : 0.0);
+    if ( control)
+    {
+        unsigned long long taken = 0;
+
+        for ( i = 0; i < channels; ++i)
+            taken += sim->status.channel[ i].taken / 2;
+
+        printf("Control page: setpoints written: %llu torn: %llu taken: %llu next zerocross error: mean %+.1f us abs %.1f us\n",
+               sim->setpointWrites, sim->setpointTorn, taken, ( sim->predictions) ? sim->predictionError / sim->predictions / 1000 : 0,
+               ( sim->predictions) ? sim->predictionAbs / sim->predictions / 1000 : 0);
+    }
+    printf("Fired: %zu of %llu half phases\n", sim->errorCount, sim->halfPhases * channels);
+    printf("Firing error: p50: %.1f us p90: %.1f us p99: %.1f us p99.9: %.1f us max: %.1f us mean: %+.1f us\n",
+           percentile( abserr, sim->errorCount, 0.5), percentile( abserr, sim->errorCount, 0.9),
+           percentile( abserr, sim->errorCount, 0.99), percentile( abserr, sim->errorCount, 0.999),
+           percentile( abserr, sim->errorCount, 1.0), bias);
+    printf("Core calls: %llu, %.0f/s simulated, %.2f M/s wall clock\n",
+           sim->calls, sim->calls / duration, ( wall > 0) ? sim->calls / wall / 1e6 : 0);
+
+    cost_print( "Edge call", &sim->edgeCost);
+    cost_print( "Timer call", &sim->timerCost);
+
+    if ( histograms)
+    {
+        hist_print( "Accepted zerocross period", &sim->core.histPeriod);
+        hist_print( "Rejected edge since the last accepted", &sim->core.histReject);
+        if ( sim->pulseWidth > 0)
+            hist_print( "Zerocross pulse width", &sim->core.histWidth);
+
+        for ( i = 0; i < channels; ++i)
+        {
+            printf("Channel %u\n", i);
+            hist_print( "Timer lateness", &sim->core.channels[ i].histLate);
+            hist_print( "Edge to fire", &sim->core.channels[ i].histFire);
+        }
+    }
+
+    if ( sim->capture)
+        fclose( sim->capture);
+
+    free( abserr);
+    free( sim->edgeCost.samples);
+    free( sim->timerCost.samples);
+    free( sim->errors);
+    free( sim);
+
+    return 0;
+}